@@ -10,33 +10,68 @@
 
 #include <linux/bug.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
 #include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/pm_qos.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
 #include <linux/seq_file.h>
 #include <linux/spinlock.h>
+#include <linux/srcu.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
 #include <linux/time64.h>
 #include <linux/types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "dht22m.h"
 
 #define DHT22M_DEVICE_NAME "dht22m"
 #define DHT22M_MODULE_NAME "dht22m"
 
-/* Maximum number of dht22 sersor handled by this module */
-#define DHT22M_MAX_DEVICES 8
+/*
+ * Maximum number of dht22 sersor handled by this module.
+ * Every sensor has static tables (about 9 KB: the read state, the failure
+ * and raw frame rings, the latency histograms, the per-CPU counters) and
+ * two minor numbers, so the default is small. More multiplexed sensors
+ * need a build with MAX_DEVICES set (see the Makefile).
+ */
+#ifndef DHT22M_MAX_DEVICES
+#define DHT22M_MAX_DEVICES 16
+#endif
+/* The configuration paths keep some per-sensor tables on the stack */
+#if DHT22M_MAX_DEVICES < 1 || DHT22M_MAX_DEVICES > 64
+#error "DHT22M_MAX_DEVICES must be between 1 and 64"
+#endif
+/* Minor numbers: the dht22mX devices followed by the dht22mX-raw devices */
+#define DHT22M_MINORS (2 * DHT22M_MAX_DEVICES)
 
 #define DHT22M_WAIT_MILLISECOND_AFTER_READ	2100
+#define DHT22M_WAIT_MILLISECOND_AFTER_READ_DHT11	1100
+/* Longer start signals are slept instead of busy waited */
+#define DHT22M_START_SLEEP_US	2000
 #define DHT22M_CHARDEV_BUFFSIZE 32
 
 #define DHT22M_STATES_ZEROCONF		0
@@ -44,587 +79,4015 @@
 #define DHT22M_STATES_GPIOERROR		2
 #define DHT22M_STATES_IRQERROR		3
 
+#define DHT22M_HEALTH_OK		0
+#define DHT22M_HEALTH_BACKOFF		1
+#define DHT22M_HEALTH_QUARANTINED	2
+
+/* Consecutive failed reads which put a sensor into quarantine */
+#define DHT22M_QUARANTINE_FAILURES	10
+/* The retry wait doubles on every failure up to this many times */
+#define DHT22M_BACKOFF_MAX_SHIFT	4
+/* A quarantined sensor is probed for life signs this often */
+#define DHT22M_PROBE_INTERVAL_MS	60000
+/* The sensor must pull the line low this fast after the start pulse */
+#define DHT22M_PROBE_RESPONSE_US	200
+/* Power off time of a power cycle and the start-up time of the sensor after it */
+#define DHT22M_POWER_OFF_MS		1000
+#define DHT22M_POWER_UP_MS		2000
+/* SCHED_FIFO priority of the acquisition thread */
+#define DHT22M_ACQ_PRIORITY		50
+/* The response and the 40 bits of a frame take at most ~5.3 ms */
+#define DHT22M_FRAME_US			6000
+/* Longest wait for the edges of an incomplete frame */
+#define DHT22M_FRAME_TIMEOUT_MS		20
+/* Maximum number of the channel select gpios of the multiplexers */
+#define DHT22M_MUX_SELECTS		4
+#define DHT22M_MUX_CHANNELS		(1 << DHT22M_MUX_SELECTS)
+/* Settling time of the multiplexer and the data line after a channel switch */
+#define DHT22M_MUX_SETTLE_US		20
+/* Error rate EWMA: fixed point scale and weight of the newest read */
+#define DHT22M_EWMA_SCALE_SHIFT		16
+#define DHT22M_EWMA_WEIGHT_SHIFT	4
+
+static bool simulate;
+module_param(simulate, bool, 0444);
+MODULE_PARM_DESC(simulate, "Simulated sensors instead of GPIOs (for benchmarks)");
+static int sim_temperature = 215;
+module_param(sim_temperature, int, 0644);
+MODULE_PARM_DESC(sim_temperature, "Simulated temperature (times ten)");
+static int sim_humidity = 450;
+module_param(sim_humidity, int, 0644);
+MODULE_PARM_DESC(sim_humidity, "Simulated humidity (times ten)");
+static unsigned int sim_noise_ns = 2000;
+module_param(sim_noise_ns, uint, 0644);
+MODULE_PARM_DESC(sim_noise_ns, "Maximum random shift of the simulated edges (ns)");
+static unsigned int sim_fail_rate;
+module_param(sim_fail_rate, uint, 0644);
+MODULE_PARM_DESC(sim_fail_rate, "Permille of the simulated frames made faulty");
+static unsigned int sim_interval_ms;
+module_param(sim_interval_ms, uint, 0644);
+MODULE_PARM_DESC(sim_interval_ms, "Minimum time between two reads of a simulated sensor (ms)");
+static bool sim_timed;
+module_param(sim_timed, bool, 0644);
+MODULE_PARM_DESC(sim_timed, "Generate the simulated edges in real time by a hrtimer");
+static unsigned int sim_latency_ns;
+module_param(sim_latency_ns, uint, 0644);
+MODULE_PARM_DESC(sim_latency_ns, "Maximum random latency injected to the timed simulated edges (ns)");
+
+static int decoder = DHT22M_DECODER_THRESHOLD;
+module_param(decoder, int, 0644);
+MODULE_PARM_DESC(decoder, "Bit decoder: 0 fixed threshold, 1 adaptive threshold");
+
+static char *gpios;
+module_param(gpios, charp, 0444);
+MODULE_PARM_DESC(gpios, "Gpios of the sensors configured at load time (like \"2,3,22\")");
+
+static char *types;
+module_param(types, charp, 0444);
+MODULE_PARM_DESC(types, "Types of the sensors configured at load time (like \"dht22,dht11,am2301,am2320\")");
+
+static unsigned int quarantine_failures = DHT22M_QUARANTINE_FAILURES;
+module_param(quarantine_failures, uint, 0644);
+MODULE_PARM_DESC(quarantine_failures, "Consecutive failures which put a sensor into quarantine (0: never)");
+
+static unsigned int probe_interval_ms = DHT22M_PROBE_INTERVAL_MS;
+module_param(probe_interval_ms, uint, 0644);
+MODULE_PARM_DESC(probe_interval_ms, "Time between the response probes of a quarantined sensor (ms)");
+
+static unsigned int period_ms;
+static int period_ms_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops period_ms_ops = {
+	.set = period_ms_set,
+	.get = param_get_uint,
+};
+module_param_cb(period_ms, &period_ms_ops, &period_ms, 0644);
+MODULE_PARM_DESC(period_ms, "Read every sensor periodically (ms, 0: only on open). "
+		 "The devices then return the last result");
+
+static unsigned int acq_priority = DHT22M_ACQ_PRIORITY;
+static int acq_priority_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops acq_priority_ops = {
+	.set = acq_priority_set,
+	.get = param_get_uint,
+};
+module_param_cb(acq_priority, &acq_priority_ops, &acq_priority, 0644);
+MODULE_PARM_DESC(acq_priority, "SCHED_FIFO priority of the acquisition thread (1-99, 0: normal)");
+
+static int acq_cpu = -1;
+static int acq_cpu_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops acq_cpu_ops = {
+	.set = acq_cpu_set,
+	.get = param_get_int,
+};
+module_param_cb(acq_cpu, &acq_cpu_ops, &acq_cpu, 0644);
+MODULE_PARM_DESC(acq_cpu, "CPU of the acquisition thread (-1: any)");
+
+static int acq_qos_us;
+module_param(acq_qos_us, int, 0644);
+MODULE_PARM_DESC(acq_qos_us, "CPU wake-up latency limit during the frames (µs, -1: no limit)");
+
+static bool acq_qos_irq_cpu;
+module_param(acq_qos_irq_cpu, bool, 0644);
+MODULE_PARM_DESC(acq_qos_irq_cpu, "Limit the wake-up latency only on the CPU of the sensor IRQ");
+
+static char *mux_gpios;
+module_param(mux_gpios, charp, 0444);
+MODULE_PARM_DESC(mux_gpios, "Channel select gpios of the sensor multiplexers, lowest bit first (like \"5,6,13\")");
+
+static bool edge_irq_no_thread = true;
+module_param(edge_irq_no_thread, bool, 0644);
+MODULE_PARM_DESC(edge_irq_no_thread, "Timestamp the edges in hard IRQ context even on PREEMPT_RT "
+		 "(IRQF_NO_THREAD, applied on the next configuration)");
+
 static DEFINE_MUTEX(gpio_config_mutex);
 
 static int sensor_states[DHT22M_MAX_DEVICES] = {0}; /* DHT22M_STATES_ZEROCONF */
 static char chardev_created[DHT22M_MAX_DEVICES] = {0};
+static char raw_chardev_created[DHT22M_MAX_DEVICES] = {0};
 static int gpio_pins[DHT22M_MAX_DEVICES] = {0};
 static int sensor_irqs[DHT22M_MAX_DEVICES] = {0};
+/* The gpio is on a sleeping controller (like an I2C or SPI expander) */
+static bool sensor_cansleep[DHT22M_MAX_DEVICES];
+/*
+ * DHT22M_TYPE_* of the sensors, set by the "type" attribute of the devices
+ * any time, so only accessed with READ_ONCE/WRITE_ONCE. A read decodes its
+ * frame with the type of its start.
+ */
+static int sensor_types[DHT22M_MAX_DEVICES];
+/* Multiplexer channel of the sensor, -1 if the sensor has its own gpio */
+static int sensor_channels[DHT22M_MAX_DEVICES];
+/* The sensor which requested the gpio and the IRQ of the data line */
+static int sensor_lines[DHT22M_MAX_DEVICES];
+/*
+ * The power control gpio of the sensor (-1: none), high level powers the
+ * sensor. power_configured is set when the gpio is requested. They may
+ * only be changed when holding gpio_config_mutex.
+ */
+static int power_pins[DHT22M_MAX_DEVICES];
+static bool power_cansleep[DHT22M_MAX_DEVICES];
+static bool power_configured[DHT22M_MAX_DEVICES];
 
 static int num_gpios = 0;
 
+/*
+ * The channel select gpios shared by all multiplexers. Requested at load
+ * time and only driven by the acquisition thread.
+ */
+static int mux_select_pins[DHT22M_MUX_SELECTS];
+static bool mux_select_cansleep[DHT22M_MUX_SELECTS];
+static int num_mux_selects;
+
+/*
+ * The state of the sensor collecting on a multiplexed data line, indexed
+ * by the first sensor of the line (sensor_lines). The IRQ handler of the
+ * line records the edges into it. Only changed by the acquisition thread.
+ */
+static struct dht22_state *mux_active[DHT22M_MAX_DEVICES];
+
+/*
+ * struct dht22_config - Published copy of the sensor configuration.
+ * The read path uses this instead of the arrays above, so it does not
+ * take gpio_config_mutex. A published table is never changed; a
+ * reconfiguration publishes a new table and frees the old one after the
+ * running readers left it.
+ *
+ * @num_gpios: Number of the configured sensors.
+ * @gpio_pins: Gpios of the sensors.
+ * @sensor_irqs: IRQs of the sensors.
+ * @sensor_states: DHT22M_STATES_* of the sensors.
+ * @sensor_cansleep: The gpios of the sensors are on sleeping controllers.
+ * @sensor_channels: Multiplexer channels of the sensors (-1: no multiplexer).
+ * @sensor_lines: The first sensors on the data lines of the sensors.
+ */
+struct dht22_config {
+	int num_gpios;
+	int gpio_pins[DHT22M_MAX_DEVICES];
+	int sensor_irqs[DHT22M_MAX_DEVICES];
+	int sensor_states[DHT22M_MAX_DEVICES];
+	bool sensor_cansleep[DHT22M_MAX_DEVICES];
+	int sensor_channels[DHT22M_MAX_DEVICES];
+	int sensor_lines[DHT22M_MAX_DEVICES];
+};
+
+/*
+ * sensor_config may only be dereferenced inside a config_srcu read side
+ * critical section and only be replaced when holding gpio_config_mutex.
+ * NULL while the sensors are (re)configured: the gpios of the old and the
+ * new configuration may overlap, so the new table can only be built after
+ * the old gpios are freed. The reads started meanwhile fail with -ENXIO,
+ * which is not a failure of the sensor. Sleepable RCU, because the
+ * readers may sleep while they drive the gpios.
+ */
+static struct dht22_config __rcu *sensor_config;
+DEFINE_STATIC_SRCU(config_srcu);
+
 static dev_t dht22m_dev;
 
 static struct cdev dht22m_cdevs[DHT22M_MAX_DEVICES];
+static struct cdev dht22m_raw_cdevs[DHT22M_MAX_DEVICES];
 static struct class *dht22m_class;
 
 static int create_devices(void);
 static void remove_devices(void);
 static int sensor_start_read(int sensor_index);
-static int sensor_decode_pulses(void);
-static int sensor_parse_bytes(void);
-
-#define DTH22M_READSTATE_COLLECT	0
-#define DTH22M_READSTATE_OK		1
-#define DTH22M_READSTATE_CHKSUMERR	2
-#define DTH22M_READSTATE_OTHERR		3
-#define DTH22M_READSTATE_TOOSOON	4
-#define DTH22M_READSTATE_NEXT		5
-/*
- * struct dht22_state - All relevant sensor state.
- * We use only one sensor state struct for all sensor.
- * If a read or calculation in progress the readstate holds
- * DTH22M_READSTATE_COLLECT, so "ReaderBudy" returned.
+struct dht22_state;
+static int sensor_decode_pulses(struct dht22_state *state);
+static int sensor_parse_bytes(struct dht22_state *state);
+static void sensor_period_kick(void);
+
+/*
+ * struct dht22_state - The read state of one sensor.
+ * Every sensor has its own state, so different sensors can be read at
+ * the same time. If a read or calculation in progress the readstate holds
+ * DTH22M_READSTATE_COLLECT, so "ReaderBusy" returned.
  * Only accept new read if readstate == DTH22M_READSTATE_NEXT
  *
- * @gpio: Gpio of the current read sensor.
- * @readstate: State of the reading process on the current sensor.
- * @num_edges: Number of detected edges during a sensor read.
- * @timestamps: Timestamps of detected edges.
+ * The fields used by the edge interrupt come first: the lock, the control
+ * fields and the first deltas are in the first cacheline, the rest of the
+ * deltas follow. Every state starts on its own cacheline, so the interrupts
+ * of different sensors handled on different CPUs do not share cachelines.
+ *
+ * @lock: Protects the state. A raw spinlock, so the edge interrupt handler
+ *        can take it in hard interrupt context on PREEMPT_RT too.
+ * @readstate: State of the reading process on the sensor.
+ * @num_edges: Number of detected edges during a sensor read
+ *             (the start of the read is the first).
+ * @gpio: Gpio of the sensor in the current read.
+ * @index: Index of the state in sensor_state. -1 for the states of the
+ *         benchmark and the replay, which are not counted in the statistics.
+ * @start: Start of the sensor read sequence.
+ * @last_edge: Time of the last detected edge.
+ * @deltas: Time between the consecutive edges in nanoseconds. The sensor
+ *          initialization sequence generates two edges (deltas[0] is the
+ *          start signal plus the response), then the 5*8 bits follow.
  * @bytes: Decoded transmitted data from a sensor read.
- * @read_timestamp: Timestamps of latest sensor read.
  * @negative: Holds the sign of the temperature (True: negative).
+ * @type: DHT22M_TYPE_* of the running or the last read.
  * @temperature: Most recently read temperature (times ten).
  * @humidity: Most recently read humidity percentage (times ten).
+ * @start_end: End of the start signal, the sensor responds after this.
+ * @read_timestamp: Timestamps of latest sensor read.
+ * @readstate_since: Time of the last readstate change.
+ * @readstate_ns: Total time spent in every readstate.
  */
 struct dht22_state {
-	int gpio;
+	raw_spinlock_t lock;
 	int readstate;
 	int num_edges;
-	/*
-	 * timestamps[0] contains the start of the sensor read sequence.
-	 * The sensor initialization sequence generates two time stamps.
-	 * We then record 5*8 timestamps to get data for five bytes.
-	 */
-	ktime_t timestamps[1 + 2 + 5*8];
-	u8 bytes[5];
+	int gpio;
+	int index;
+	ktime_t start;
+	ktime_t last_edge;
+	u32 deltas[DHT22M_FRAME_EDGES - 1];
 
-	ktime_t read_timestamp;
+	u8 bytes[5];
 	bool negative;
+	u8 type;
 	int temperature;
 	int humidity;
+	ktime_t start_end;
+	ktime_t read_timestamp;
+	ktime_t readstate_since;
+	u64 readstate_ns[DTH22M_READSTATE_NEXT + 1];
+} ____cacheline_aligned_in_smp;
+
+/*
+ * sensor_state[i] may only be accessed when holding sensor_state[i].lock.
+ */
+static struct dht22_state sensor_state[DHT22M_MAX_DEVICES];
+
+/*
+ * struct dht22_sensor_counters - Statistics counters of one sensor.
+ * @edges: Edges recorded during the reads.
+ * @stray_edges: Edges out of the reads or after a complete frame.
+ * @irq_ns: Time spent in the edge interrupt handler. Approximate: the
+ *          interrupt entry and exit are not included.
+ * @busy_rejects: Reads rejected with -EBUSY (read in progress or too soon).
+ * @results: Number of finished reads by their DTH22M_READSTATE_* result.
+ * @busywait_ns: Busy waiting (udelay) of the start signals and probes.
+ * @decode_ns: Decoding the recorded edges.
+ * @deliver_ns: Captures, health update, formatting and copy to userspace.
+ */
+struct dht22_sensor_counters {
+	u64 edges;
+	u64 stray_edges;
+	u64 irq_ns;
+	u64 busy_rejects;
+	u64 results[DTH22M_READSTATE_NEXT + 1];
+	u64 busywait_ns;
+	u64 decode_ns;
+	u64 deliver_ns;
 };
 
+/* The locks with contention statistics */
+#define DHT22M_LOCK_CONFIG	0	/* gpio_config_mutex */
+#define DHT22M_LOCK_SENSOR	1	/* The locks of sensor_state, summed */
+#define DHT22M_LOCKS		2
+
 /*
- * sensor_state may only be accessed when holding sensor_lock.
+ * struct dht22_lock_counters - Contention statistics of a lock.
+ * @acquisitions: Number of times the lock was taken.
+ * @contended: Number of times the lock was held by someone else.
+ * @wait_ns: Total time spent waiting for the lock.
  */
-static struct dht22_state sensor_state;
-static DEFINE_SPINLOCK(sensor_lock);  /* Protects sensor_state. */
+struct dht22_lock_counters {
+	u64 acquisitions;
+	u64 contended;
+	u64 wait_ns;
+};
 
 /*
- * s_handle_edge() - process interrupt due to falling edge on GPIO pin.
- * @irq: Then IRQ number. Unused.
- * @dev_id: Holds the gpio of the current read sensor.
- *
- * Records the timestamp of a falling edge (high to low) on the DHT22
- * sensor pin. Prior to the read sequence, sensor_state.timestamps[0]
- * has already been set to the current timestamp and sensor_state.num_edges
- * has been set to 1.
- *
- * During a sensor read, there are in total 42 falling edges: two during
- * the setup phase and then one for each transmitted bit of information.
- * The transmission of each bit starts with the signal going low for 50 µs.
- * Then signal goes high for 22-30 µs when 0 is transmitted; signal goes high
- * for 68-75 µs when 1 is transmitted.
+ * struct dht22_counters - All statistics counters of the module.
+ * Only holds u64 counters, the per-CPU counters have the same layout.
+ */
+struct dht22_counters {
+	struct dht22_sensor_counters sensors[DHT22M_MAX_DEVICES];
+	struct dht22_lock_counters locks[DHT22M_LOCKS];
+};
+
+/* Number of counters in struct dht22_counters */
+#define DHT22M_COUNTERS		(sizeof(struct dht22_counters) / sizeof(u64))
+
+/*
+ * struct dht22_stats - The statistics counters of one CPU.
+ * @syncp: Lets the readers get whole 64 bit values on 32 bit systems.
+ * @counters: The counters in the order of struct dht22_counters.
+ */
+struct dht22_stats {
+	struct u64_stats_sync syncp;
+	u64_stats_t counters[DHT22M_COUNTERS];
+};
+
+/*
+ * Every CPU only updates its own dht22_stats (with sensor_stats_add() or
+ * between sensor_stats_begin() and sensor_stats_end()), so the counters
+ * need no atomics or shared cachelines. The edge interrupt updates the
+ * same counters as the process context (the lock acquisitions), and on
+ * 32 bit systems a u64_stats_t update is two stores that it could tear.
+ * u64_stats_update_begin_irqsave() does not prevent that on UP (where it
+ * is a no-op) or on PREEMPT_RT (where it only disables preemption), so
+ * sensor_stats_begin() disables the interrupts itself.
+ * The readers sum the counters of all CPUs with sensor_stats_fold().
+ */
+static DEFINE_PER_CPU(struct dht22_stats, dht22_stats);
+
+/*
+ * The sensor counters at the last sensor_stats_reset(), subtracted by
+ * sensor_stats_fold(). The per-CPU counters are never cleared.
+ */
+static DEFINE_SPINLOCK(stats_lock);  /* Protects stats_baseline. */
+static struct dht22_counters stats_baseline;
+
+/*
+ * sensor_stats_begin() - Start updating the counters of the current CPU.
+ * @flags: Saved interrupt state for sensor_stats_end().
  *
- * Return: IRQ_HANDLED
+ * Return: The counters of the current CPU.
  */
-static irqreturn_t s_handle_edge(int irq, void *dev_id)
+static struct dht22_stats *sensor_stats_begin(unsigned long *flags)
 {
-	int *gpio_num = (int *)dev_id;
-	const ktime_t now = ktime_get();
-	unsigned long flags;
+	struct dht22_stats *stats;
 
-	spin_lock_irqsave(&sensor_lock, flags);
-	if (sensor_state.readstate != DTH22M_READSTATE_COLLECT)
-		goto irq_handled;
-	if (sensor_state.gpio != *gpio_num)
-		goto irq_handled;
-	if (sensor_state.num_edges <= 0)
-		goto irq_handled;
-	/* Start storing timestamps after the long start pulse happened. */
-	if (sensor_state.num_edges == 1) {
-		s64 width = ktime_to_us(now - sensor_state.timestamps[0]);
-		if (width < 500)
-			goto irq_handled;
-	}
-	if (sensor_state.num_edges < sizeof sensor_state.timestamps) {
-		sensor_state.timestamps[sensor_state.num_edges++] = now;
+	local_irq_save(*flags);
+	stats = this_cpu_ptr(&dht22_stats);
+	u64_stats_update_begin(&stats->syncp);
+	return stats;
+}
+
+/* sensor_stats_end() - Finish the update started by sensor_stats_begin() */
+static void sensor_stats_end(unsigned long flags)
+{
+	struct dht22_stats *stats = this_cpu_ptr(&dht22_stats);
+
+	u64_stats_update_end(&stats->syncp);
+	local_irq_restore(flags);
+}
+
+/*
+ * sensor_stats_counter() - One counter of a CPU.
+ * @stats: The counters returned by sensor_stats_begin().
+ * @counter: A member of struct dht22_counters, like sensors[i].edges
+ */
+#define sensor_stats_counter(stats, counter)				\
+	(&(stats)->counters[offsetof(struct dht22_counters, counter) / sizeof(u64)])
+
+/*
+ * sensor_stats_add() - Add a value to one counter of the current CPU.
+ * The counter is given as a member of struct dht22_counters.
+ */
+#define sensor_stats_add(counter, value)				\
+	do {								\
+		unsigned long __flags;					\
+									\
+		u64_stats_add(sensor_stats_counter(sensor_stats_begin(&__flags), \
+						   counter), (value));	\
+		sensor_stats_end(__flags);				\
+	} while (0)
+
+/*
+ * sensor_stats_sum() - Sum the counters of all CPUs.
+ * @sum: The result.
+ */
+static void sensor_stats_sum(struct dht22_counters *sum)
+{
+	u64 *total = (u64 *)sum;
+	const struct dht22_stats *stats;
+	unsigned int start;
+	u64 value;
+	int cpu, i;
+
+	BUILD_BUG_ON(sizeof *sum % sizeof(u64));
+	memset(sum, 0, sizeof *sum);
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(&dht22_stats, cpu);
+		for (i = 0; i < DHT22M_COUNTERS; i++) {
+			do {
+				start = u64_stats_fetch_begin(&stats->syncp);
+				value = u64_stats_read(&stats->counters[i]);
+			} while (u64_stats_fetch_retry(&stats->syncp, start));
+			total[i] += value;
+		}
 	}
- irq_handled:
-	spin_unlock_irqrestore(&sensor_lock, flags);
-	return IRQ_HANDLED;
 }
 
 /*
- * sensor_start_read() - reading data from the DHT22 sensor.
- * @sensor_index: Index of the sensor in gpio_pins, sensor_state, sensor_irqs arrays.
- *
- * The protocol for starting a sensor read is to first pull the GPIO pin
- * low for at least 1ms (we pull it low for 1.5ms) and then pull the pin
- * high and wait for the sensor to respond with an 80µs low pulse followed
- * by an 80µs high pulse. After that initial response, the sensor sends 40
- * pulses whose widths encode the actual sensor data. The pulses are
- * recorded by our interrupt handler; we simply wait for 10ms so that the
- * read cycle finishes and then process the data in sensor_state. The
- * pulses are collected by an interrupt on falling edge on the GPIO pin.
+ * sensor_stats_fold() - The counters since the last sensor_stats_reset().
+ * @sum: The result. Large, so the callers allocate it.
+ */
+static void sensor_stats_fold(struct dht22_counters *sum)
+{
+	const int n = DHT22M_MAX_DEVICES *
+		      sizeof(struct dht22_sensor_counters) / sizeof(u64);
+	const u64 *baseline = (const u64 *)stats_baseline.sensors;
+	u64 *total = (u64 *)sum->sensors;
+	unsigned long flags;
+	int i;
+
+	sensor_stats_sum(sum);
+	spin_lock_irqsave(&stats_lock, flags);
+	for (i = 0; i < n; i++)
+		total[i] -= baseline[i];
+	spin_unlock_irqrestore(&stats_lock, flags);
+}
+
+/*
+ * sensor_stats_reset() - Restart the counters of the sensors from zero.
+ * Called on (re)configuration with gpio_config_mutex held. The lock
+ * statistics are kept.
  *
- * Return: 0 on success; -EBUSY or -EIO on error.
+ * The other CPUs may be updating their counters, so they are not cleared:
+ * their current sum becomes the baseline of sensor_stats_fold().
  */
-static int sensor_start_read(int sensor_index)
+static void sensor_stats_reset(void)
 {
-	const ktime_t now = ktime_get();
-	s64 timestamp_diff;
 	unsigned long flags;
 
-	mutex_lock(&gpio_config_mutex);
-	spin_lock_irqsave(&sensor_lock, flags);
+	spin_lock_irqsave(&stats_lock, flags);
+	sensor_stats_sum(&stats_baseline);
+	spin_unlock_irqrestore(&stats_lock, flags);
+}
 
-	if (sensor_state.readstate != DTH22M_READSTATE_NEXT) {
-		spin_unlock_irqrestore(&sensor_lock, flags);
-		mutex_unlock(&gpio_config_mutex);
-		return -EBUSY;
-	}
+/* sensor_counters_samples() - Number of finished reads of a sensor */
+static u64 sensor_counters_samples(const struct dht22_sensor_counters *counters)
+{
+	return counters->results[DTH22M_READSTATE_OK] +
+	       counters->results[DTH22M_READSTATE_CHKSUMERR] +
+	       counters->results[DTH22M_READSTATE_OTHERR];
+}
 
-	if (sensor_states[sensor_index] != DHT22M_STATES_CONFIGURED) {
-		sensor_state.readstate = DTH22M_READSTATE_OTHERR;
-		spin_unlock_irqrestore(&sensor_lock, flags);
-		mutex_unlock(&gpio_config_mutex);
-		return -EIO;
-	}
+/* lock_stats_contended() - Account a contended acquisition of a lock */
+static void lock_stats_contended(int lock, ktime_t start)
+{
+	struct dht22_stats *stats;
+	unsigned long flags;
+	s64 wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-	timestamp_diff = ktime_to_ms(now - sensor_state.read_timestamp);
-	if (sensor_state.gpio == gpio_pins[sensor_index] &&
-	    timestamp_diff < DHT22M_WAIT_MILLISECOND_AFTER_READ) {
-		sensor_state.readstate = DTH22M_READSTATE_TOOSOON;
-		spin_unlock_irqrestore(&sensor_lock, flags);
-		mutex_unlock(&gpio_config_mutex);
-		return -EBUSY;
-	}
+	stats = sensor_stats_begin(&flags);
+	u64_stats_inc(sensor_stats_counter(stats, locks[lock].contended));
+	u64_stats_add(sensor_stats_counter(stats, locks[lock].wait_ns), wait_ns);
+	sensor_stats_end(flags);
+}
 
-	sensor_state.gpio = gpio_pins[sensor_index];
-	sensor_state.readstate = DTH22M_READSTATE_COLLECT;
-	sensor_state.negative = false;
-	sensor_state.temperature = 0;
-	sensor_state.humidity = 0;
-	sensor_state.timestamps[0] = now;
-	sensor_state.num_edges = 1;
-	spin_unlock_irqrestore(&sensor_lock, flags);
+/* config_mutex_lock() - Take gpio_config_mutex and account the waiting */
+static void config_mutex_lock(void)
+{
+	ktime_t start;
 
-	/* We send the 1500 µs low signal to start the reading process */
-	if (gpio_direction_output(sensor_state.gpio, 0)) {
-		printk(KERN_ALERT DHT22M_MODULE_NAME
-		       ": gpio_direction_output failed\n");
-		goto start_seq_error;
-	}
-	udelay(1500);
-	gpio_set_value(sensor_state.gpio, 1);
+	sensor_stats_add(locks[DHT22M_LOCK_CONFIG].acquisitions, 1);
+	if (mutex_trylock(&gpio_config_mutex))
+		return;
+	start = ktime_get();
+	mutex_lock(&gpio_config_mutex);
+	lock_stats_contended(DHT22M_LOCK_CONFIG, start);
+}
 
-	/* End of active send, start collecting data */
-	if (gpio_direction_input(sensor_state.gpio)) {
-		printk(KERN_ALERT DHT22M_MODULE_NAME
-		       ": gpio_direction_input failed\n");
-		goto start_seq_error;
-	}
-	mutex_unlock(&gpio_config_mutex);
-	return 0;
+/* sensor_lock_contended() - Wait for a state lock, see sensor_lock_irqsave() */
+static unsigned long sensor_lock_contended(struct dht22_state *state)
+{
+	const ktime_t start = ktime_get();
+	unsigned long flags;
 
-start_seq_error:
-	spin_lock_irqsave(&sensor_lock, flags);
-	sensor_state.readstate = DTH22M_READSTATE_OTHERR;
-	spin_unlock_irqrestore(&sensor_lock, flags);
-	mutex_unlock(&gpio_config_mutex);
-	return -EIO;
+	raw_spin_lock_irqsave(&state->lock, flags);
+	lock_stats_contended(DHT22M_LOCK_SENSOR, start);
+	return flags;
 }
 
 /*
- * sensor_decode_pulses() - decode pulse widths and validate checksum.
- *
- * May only be called when holding sensor_lock.
- *
- * Translates pulse widths into bit values; stores the result in sensor_state.
- * Validates the checksum.
+ * sensor_lock_irqsave() - Take the lock of a sensor state and account the waiting.
+ * Released with raw_spin_unlock_irqrestore(&state->lock, flags).
+ * The statistics of all sensor state locks are summed in DHT22M_LOCK_SENSOR,
+ * the states out of sensor_state are not accounted.
+ */
+#define sensor_lock_irqsave(state, flags)				\
+	do {								\
+		if ((state)->index < 0) {				\
+			raw_spin_lock_irqsave(&(state)->lock, flags);	\
+		} else {						\
+			sensor_stats_add(locks[DHT22M_LOCK_SENSOR].acquisitions, 1); \
+			if (!raw_spin_trylock_irqsave(&(state)->lock, flags)) \
+				flags = sensor_lock_contended(state);	\
+		}							\
+	} while (0)
+
+/*
+ * sensor_set_readstate() - Change the readstate of a sensor state.
+ * @state: The sensor state.
+ * @readstate: The new DTH22M_READSTATE_* value.
  *
- * Return: 0 on success; -EIO on input error.
+ * Accounts the time spent in the previous readstate.
+ * May only be called when holding state->lock.
  */
-static int sensor_decode_pulses(void)
+static void sensor_set_readstate(struct dht22_state *state, int readstate)
 {
-	int i;
-	u8 sum;
-	/*
-	 * The last falling edge which is the end of the start sequence occurs
-	 * at index 2 in the array of timestamps. Each falling edge after that
-	 * defines a pulse which encodes one bit.
-	 */
-	BUILD_BUG_ON(sizeof sensor_state.timestamps < 5*8+3);
-	BUILD_BUG_ON(sizeof sensor_state.bytes < 5);
-	if (sensor_state.num_edges < 5*8+3) {
-		sensor_state.readstate = DTH22M_READSTATE_OTHERR;
-		return -EIO;
-	}
-	memset(sensor_state.bytes, 0, sizeof sensor_state.bytes);
-	for (i = 0; i < 5*8; i++) {
-		const ktime_t this = sensor_state.timestamps[i+3];
-		const ktime_t last = sensor_state.timestamps[i+2];
-		const s64 width = ktime_to_us(this - last);
-		/*
-		 * Since we zeroed out the bytes array before the loop,
-		 * we only have to update bytes when we read a 1 (which
-		 * is encoded as a long pulse) from the sensor. We use 101µs
-		 * as the boundary between reading a 0 and reading a 1.
-		 * According to the data sheet: (Aosong AM2302)
-		 *                             Min   Typ   Max  (µs)
-		 *  Signal "0", "1" low time   48    50    55
-		 *  Signal "0" high time       22    26    30
-		 *  Signal "1" high time       68    70    75
-		 * Derived: longest "0" period is 85, the shortest "1" period is 116
-		 * the middle between two values is ~ 101 µs
-		 */
-		if (width > 101) {
-			sensor_state.bytes[i / 8] |= 1 << (7 - (i & 7));
-		}
-	}
-	sum = (sensor_state.bytes[0] + sensor_state.bytes[1] +
-	       sensor_state.bytes[2] + sensor_state.bytes[3]);
-	if (sum != sensor_state.bytes[4]) {
-		sensor_state.readstate = DTH22M_READSTATE_CHKSUMERR;
-		return 0;
-	}
-	sensor_state.readstate = DTH22M_READSTATE_OK;
-	return 0;
+	const ktime_t now = ktime_get();
+
+	if (state->readstate >= 0 && state->readstate <= DTH22M_READSTATE_NEXT)
+		state->readstate_ns[state->readstate] +=
+			ktime_to_ns(ktime_sub(now, state->readstate_since));
+	state->readstate_since = now;
+	state->readstate = readstate;
 }
 
+/* Number of failed frames kept for every sensor */
+#define DHT22M_FAILURE_RING_SIZE	16
+
+/*
+ * struct dht22_failure_ring - The last failed frames of a sensor.
+ * @count: Number of frames captured so far, the next goes to count % size.
+ * @frames: The captured frames.
+ * @streamed: The frame went to the raw device too, its sequence is valid.
+ */
+struct dht22_failure_ring {
+	unsigned int count;
+	struct dht22m_frame frames[DHT22M_FAILURE_RING_SIZE];
+	bool streamed[DHT22M_FAILURE_RING_SIZE];
+};
+
+/*
+ * failure_rings may only be accessed when holding failure_lock.
+ */
+static struct dht22_failure_ring failure_rings[DHT22M_MAX_DEVICES];
+static DEFINE_SPINLOCK(failure_lock);  /* Protects failure_rings. */
+
+/* Number of frames buffered for the readers of a raw device */
+#define DHT22M_RAW_RING_SIZE	16
+
+/*
+ * struct dht22_raw_ring - The last frames of a sensor for the raw device.
+ * @count: Number of frames captured so far, the next goes to count % size.
+ *         The readers use it as the sequence number of the next frame.
+ * @readers: Number of open raw devices. Frames are only captured if nonzero.
+ * @wait: Readers wait here for the next frame.
+ * @frames: The captured frames.
+ */
+struct dht22_raw_ring {
+	u32 count;
+	atomic_t readers;
+	wait_queue_head_t wait;
+	struct dht22m_frame frames[DHT22M_RAW_RING_SIZE];
+};
+
+/*
+ * The frames and the count of raw_rings may only be accessed
+ * when holding raw_lock.
+ */
+static struct dht22_raw_ring raw_rings[DHT22M_MAX_DEVICES];
+static DEFINE_SPINLOCK(raw_lock);  /* Protects raw_rings. */
+
+static struct dentry *dht22m_debugfs;
+static struct dentry *sensor_debugfs[DHT22M_MAX_DEVICES];
+
 /*
- * sensor_parse_bytes() - parsing 4 byte data read from the DHT22 sensor.
+ * struct dht22_health - Health tracking of one sensor.
+ * A failing sensor is retried with an increasing wait (backoff). After
+ * quarantine_failures consecutive failures the sensor is put into
+ * quarantine: its IRQ is disabled and no reads are started, only a cheap
+ * response probe is sent in every probe_interval_ms. A sensor with a power
+ * gpio is probed right away and power cycled if it does not respond.
+ * The sensors on sleeping controllers are not polled, their probe is a
+ * trial read, see sensor_health_admit().
  *
- * Check that the right number of bits have been read and that the checksum is
- * correct. If those checks pass, update read_timestamp, humidity and
- * temperature fields in sensor_state with the newly read data.
+ * @state: DHT22M_HEALTH_OK, DHT22M_HEALTH_BACKOFF or DHT22M_HEALTH_QUARANTINED
+ * @consecutive_failures: Number of failed reads since the last good one.
+ * @error_ewma: Moving average of the failure rate (1 << DHT22M_EWMA_SCALE_SHIFT = 100%).
+ * @reads: Number of finished reads.
+ * @failures: Number of failed reads.
+ * @quarantines: Number of times the sensor was put into quarantine.
+ * @next_allowed: No read is started on the sensor before this time.
+ * @power_cycles: Number of power cycles of the sensor.
+ * @trial_read: The sensor was released from quarantine and has not read
+ *              successfully since.
+ * @irq_disabled: The sensor IRQ is disabled by the quarantine.
+ *                Protected by gpio_config_mutex instead of health_lock.
+ * @powered_off: The sensor is switched off by a power cycle.
+ *               Protected by gpio_config_mutex instead of health_lock.
+ */
+struct dht22_health {
+	int state;
+	unsigned int consecutive_failures;
+	u32 error_ewma;
+	u64 reads;
+	u64 failures;
+	unsigned int quarantines;
+	ktime_t next_allowed;
+	unsigned int power_cycles;
+	bool trial_read;
+	bool irq_disabled;
+	bool powered_off;
+};
+
+/*
+ * sensor_health may only be accessed when holding health_lock.
+ */
+static struct dht22_health sensor_health[DHT22M_MAX_DEVICES];
+static DEFINE_SPINLOCK(health_lock);  /* Protects sensor_health. */
+
+/*
+ * struct dht22_sample - The cached result of the last reads of a sensor.
+ * Readers of the summaries use this instead of reading the sensor.
  *
- * Return: 0 on success; -EIO on error.
+ * @readstate: Result of the last finished read, DTH22M_READSTATE_NEXT if none.
+ * @read_time: Time of the last finished read.
+ * @valid: The sample fields below hold a successful read.
+ * @negative: Sign of the temperature (True: negative).
+ * @temperature: Last successfully read temperature (times ten).
+ * @humidity: Last successfully read humidity percentage (times ten).
+ * @sample_time: Time of the last successful read.
+ */
+struct dht22_sample {
+	int readstate;
+	ktime_t read_time;
+	bool valid;
+	bool negative;
+	int temperature;
+	int humidity;
+	ktime_t sample_time;
+};
+
+/*
+ * struct dht22_sample_record - Published sample of a sensor.
+ * @seq: Readers retry their copy if the sample changed meanwhile.
+ * @sample: The sample, replaced as a whole by the writers.
+ *
+ * The readers never take a lock or disable interrupts, see
+ * sensor_sample_copy(). Every record is in its own cacheline.
+ */
+struct dht22_sample_record {
+	seqcount_spinlock_t seq;
+	struct dht22_sample sample;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * sensor_samples may only be changed when holding sample_lock (process
+ * context only) and read with sensor_sample_copy().
+ */
+static struct dht22_sample_record sensor_samples[DHT22M_MAX_DEVICES];
+static DEFINE_SPINLOCK(sample_lock);  /* Serializes the writers of sensor_samples. */
+
+static struct proc_dir_entry *dht22m_proc_metrics;
+static struct proc_dir_entry *dht22m_proc_summary;
+
+/* Phases of a sensor read measured by the latency histograms */
+#define DHT22M_PHASE_START	0	/* Sending the start signal */
+#define DHT22M_PHASE_RESPONSE	1	/* End of start signal to the first bit */
+#define DHT22M_PHASE_TRANSFER	2	/* The 40 bits */
+#define DHT22M_PHASE_OVERSLEEP	3	/* Sleeping longer than the frame wait */
+#define DHT22M_PHASE_DECODE	4	/* Decoding the recorded edges */
+#define DHT22M_PHASE_DELIVER	5	/* Captures, health and the result message */
+#define DHT22M_PHASE_BIT_ERROR	6	/* Largest timing error of a bit period */
+#define DHT22M_PHASE_QUEUE	7	/* Request to the start signal of the sensor */
+#define DHT22M_PHASE_COPYOUT	8	/* Copy of the result to the reader */
+#define DHT22M_PHASE_TOTAL	9	/* Request to the decoded result */
+#define DHT22M_PHASES		10
+
+/*
+ * Bucket 0 counts the durations below 1 µs, bucket i (i > 0) the
+ * durations in [2^(i-1), 2^i) µs. The last bucket holds everything longer.
+ */
+#define DHT22M_LATENCY_BUCKETS	24
+
+static const char * const latency_phase_names[DHT22M_PHASES] = {
+	"start", "response", "transfer",
+	"oversleep", "decode", "deliver", "bit_error", "queue", "copyout",
+	"total"
+};
+
+/*
+ * struct dht22_latency_hist - Log2 histogram of one phase of the reads.
+ * @count: Number of measurements.
+ * @sum_ns: Sum of the measured durations.
+ * @max_ns: Longest measured duration.
+ * @buckets: Number of measurements in every DHT22M_LATENCY_BUCKETS bucket.
+ */
+struct dht22_latency_hist {
+	u64 count;
+	u64 sum_ns;
+	u64 max_ns;
+	u64 buckets[DHT22M_LATENCY_BUCKETS];
+};
+
+/*
+ * sensor_latency may only be accessed when holding latency_lock.
+ */
+static struct dht22_latency_hist sensor_latency[DHT22M_MAX_DEVICES][DHT22M_PHASES];
+static DEFINE_SPINLOCK(latency_lock);  /* Protects sensor_latency. */
+
+/*
+ * sensor_latency_record() - Add a measured duration to a histogram.
+ * @sensor_index: Index of the sensor.
+ * @phase: DHT22M_PHASE_* value.
+ * @ns: The duration, negative values are counted as zero.
  */
-static int sensor_parse_bytes(void)
+static void sensor_latency_record(int sensor_index, int phase, s64 ns)
 {
+	struct dht22_latency_hist *hist = &sensor_latency[sensor_index][phase];
 	unsigned long flags;
-	spin_lock_irqsave(&sensor_lock, flags);
-	sensor_decode_pulses();
-	if (sensor_state.readstate != DTH22M_READSTATE_OK)
-		goto end_parse_bytes;
-	sensor_state.read_timestamp = sensor_state.timestamps[sensor_state.num_edges - 1];
-	sensor_state.negative = false;
-	sensor_state.humidity = (sensor_state.bytes[0] * 256 + sensor_state.bytes[1]);
-	sensor_state.temperature = ((sensor_state.bytes[2] & 0x7F) * 256 +
-				   sensor_state.bytes[3]);
-	if (sensor_state.bytes[2] & 0x80) {
-		sensor_state.negative = true;
-	}
-end_parse_bytes:
-	spin_unlock_irqrestore(&sensor_lock, flags);
-	return 0;
+	u64 us;
+	int bucket;
+
+	if (ns < 0)
+		ns = 0;
+	us = div_u64(ns, NSEC_PER_USEC);
+	bucket = us ? min_t(int, ilog2(us) + 1, DHT22M_LATENCY_BUCKETS - 1) : 0;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[bucket]++;
+	spin_unlock_irqrestore(&latency_lock, flags);
 }
 
 /*
- * configure_gpios() - Configure the gpios according to the gpio_pins array
+ * struct dht22_cpu_cost - CPU time spent by the module on a sensor.
+ * Collected during one operation, then added to the counters of the sensor.
+ * @busywait_ns: Busy waiting (udelay) of the start signals and probes.
+ * @decode_ns: Decoding the recorded edges.
+ * @deliver_ns: Captures, health update, formatting and copy to userspace.
+ */
+struct dht22_cpu_cost {
+	u64 busywait_ns;
+	u64 decode_ns;
+	u64 deliver_ns;
+};
+
+/*
+ * sensor_cpu_account() - Add CPU time to the cost of a sensor.
+ * @sensor_index: Index of the sensor.
+ * @cost: The time to add.
+ */
+static void sensor_cpu_account(int sensor_index, const struct dht22_cpu_cost *cost)
+{
+	struct dht22_stats *stats;
+	unsigned long flags;
+
+	stats = sensor_stats_begin(&flags);
+	u64_stats_add(sensor_stats_counter(stats,
+			sensors[sensor_index].busywait_ns), cost->busywait_ns);
+	u64_stats_add(sensor_stats_counter(stats,
+			sensors[sensor_index].decode_ns), cost->decode_ns);
+	u64_stats_add(sensor_stats_counter(stats,
+			sensors[sensor_index].deliver_ns), cost->deliver_ns);
+	sensor_stats_end(flags);
+}
+
+/*
+ * sensor_min_interval_ms() - Minimum time between two reads of a sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * The DHT11 may be read every second, the others every two seconds.
+ * The retry backoff of failing sensors is the multiple of this too.
+ */
+static unsigned int sensor_min_interval_ms(int sensor_index)
+{
+	if (simulate)
+		return READ_ONCE(sim_interval_ms);
+	if (READ_ONCE(sensor_types[sensor_index]) == DHT22M_TYPE_DHT11)
+		return DHT22M_WAIT_MILLISECOND_AFTER_READ_DHT11;
+	return DHT22M_WAIT_MILLISECOND_AFTER_READ;
+}
+
+/*
+ * sensor_record_edge() - Store the time of a falling edge.
+ * @state: The state of the sensor.
+ * @now: Time of the edge.
+ *
+ * The common part of the interrupt handler and the simulated sensors.
+ *
+ * Return: True if the edge is part of the frame, false if it is a stray edge.
+ */
+static bool sensor_record_edge(struct dht22_state *state, ktime_t now)
+{
+	unsigned long flags;
+	bool recorded = false;
+
+	sensor_lock_irqsave(state, flags);
+	if (state->readstate != DTH22M_READSTATE_COLLECT)
+		goto edge_recorded;
+	if (state->num_edges <= 0)
+		goto edge_recorded;
+	/* Start storing timestamps after the long start pulse happened. */
+	if (state->num_edges == 1) {
+		s64 width = ktime_to_us(now - state->start);
+		if (width < 500)
+			goto edge_recorded;
+	}
+	if (state->num_edges < DHT22M_FRAME_EDGES) {
+		state->deltas[state->num_edges - 1] =
+			clamp_t(s64, ktime_to_ns(now - state->last_edge), 0, U32_MAX);
+		state->last_edge = now;
+		state->num_edges++;
+		recorded = true;
+	}
+ edge_recorded:
+	raw_spin_unlock_irqrestore(&state->lock, flags);
+	return recorded;
+}
+
+/*
+ * sensor_stats_edge() - Count an edge of a sensor.
+ * @state: The state of the sensor, states out of sensor_state are ignored.
+ * @recorded: The edge is part of the frame.
+ * @irq_ns: Time spent in the interrupt handler.
+ */
+static void sensor_stats_edge(struct dht22_state *state, bool recorded,
+			      u64 irq_ns)
+{
+	const int sensor_index = state->index;
+	struct dht22_stats *stats;
+	unsigned long flags;
+
+	/* The benchmark calls the handler with a state outside of sensor_state */
+	if (sensor_index < 0)
+		return;
+	stats = sensor_stats_begin(&flags);
+	if (recorded)
+		u64_stats_inc(sensor_stats_counter(stats,
+				sensors[sensor_index].edges));
+	else
+		u64_stats_inc(sensor_stats_counter(stats,
+				sensors[sensor_index].stray_edges));
+	u64_stats_add(sensor_stats_counter(stats, sensors[sensor_index].irq_ns),
+		      irq_ns);
+	sensor_stats_end(flags);
+}
+
+/*
+ * s_handle_edge() - process interrupt due to falling edge on GPIO pin.
+ * @irq: Then IRQ number. Unused.
+ * @dev_id: The state of the sensor.
+ *
+ * Records the timestamp of a falling edge (high to low) on the DHT22
+ * sensor pin. Prior to the read sequence, state->start and
+ * state->last_edge have already been set to the current timestamp and
+ * state->num_edges has been set to 1.
+ *
+ * During a sensor read, there are in total 42 falling edges: two during
+ * the setup phase and then one for each transmitted bit of information.
+ * The transmission of each bit starts with the signal going low for 50 µs.
+ * Then signal goes high for 22-30 µs when 0 is transmitted; signal goes high
+ * for 68-75 µs when 1 is transmitted.
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t s_handle_edge(int irq, void *dev_id)
+{
+	struct dht22_state *state = dev_id;
+	const ktime_t now = ktime_get();
+	bool recorded;
+
+	recorded = sensor_record_edge(state, now);
+	sensor_stats_edge(state, recorded, ktime_to_ns(ktime_sub(ktime_get(), now)));
+	return IRQ_HANDLED;
+}
+
+/*
+ * s_handle_mux_edge() - Falling edge on the data line of a multiplexer.
+ * @irq: Then IRQ number.
+ * @dev_id: The mux_active entry of the line.
+ *
+ * The edge belongs to the sensor on the selected channel.
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t s_handle_mux_edge(int irq, void *dev_id)
+{
+	struct dht22_state **active = dev_id;
+
+	return s_handle_edge(irq, READ_ONCE(*active));
+}
+
+/*
+ * sensor_irq_dev_id() - The dev_id of the IRQ requested for a sensor.
+ * @sensor_index: Index of the first sensor of a data line.
+ */
+static void *sensor_irq_dev_id(int sensor_index)
+{
+	if (sensor_channels[sensor_index] >= 0)
+		return &mux_active[sensor_index];
+	return &sensor_state[sensor_index];
+}
+
+/*
+ * struct dht22_sim_timer - Real time edge generator of the simulated sensors.
+ * @timer: Fires at the edges of the simulated transfer.
+ * @state: The state of the simulated sensor.
+ * @next: Index of the next edge in @edges.
+ * @count: Number of the edges in the frame.
+ * @edges: Planned times of the falling edges.
+ */
+struct dht22_sim_timer {
+	struct hrtimer timer;
+	struct dht22_state *state;
+	int next;
+	int count;
+	ktime_t edges[DHT22M_FRAME_EDGES - 1];
+};
+
+/* Every sensor has a generator, the sensors can be read at the same time */
+static struct dht22_sim_timer sim_timers[DHT22M_MAX_DEVICES];
+
+/* sim_edge_latency() - Random IRQ latency injected to a timed simulated edge */
+static u64 sim_edge_latency(void)
+{
+	unsigned int latency = READ_ONCE(sim_latency_ns);
+
+	return latency ? get_random_u32() % (latency + 1) : 0;
+}
+
+/*
+ * sim_timer_fire() - Hrtimer handler of the timed simulated sensors.
+ *
+ * Records the edge with the current time (as s_handle_edge() does) and
+ * sets the timer to the next edge plus the injected latency.
+ */
+static enum hrtimer_restart sim_timer_fire(struct hrtimer *timer)
+{
+	struct dht22_sim_timer *sim = container_of(timer, struct dht22_sim_timer,
+						   timer);
+
+	sensor_stats_edge(sim->state, sensor_record_edge(sim->state, ktime_get()), 0);
+	if (++sim->next >= sim->count)
+		return HRTIMER_NORESTART;
+	hrtimer_set_expires(timer, ktime_add_ns(sim->edges[sim->next],
+						sim_edge_latency()));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * sensor_sim_frame() - Generate the edges of a simulated sensor read.
+ * @sensor_index: Index of the sensor.
+ * @start: Start time of the read (timestamps[0]).
+ * @type: DHT22M_TYPE_* of the read.
+ *
+ * Encodes sim_temperature and sim_humidity as a sensor of the type would
+ * and computes the falling edges of the transfer from the nominal timings
+ * of the data sheet. Every edge is shifted by a random noise of at most
+ * sim_noise_ns and sim_fail_rate permille of the frames get a flipped bit
+ * (checksum error) or lose their tail (missing edges).
+ * Without sim_timed the edges are fed to sensor_record_edge() right away,
+ * otherwise a hrtimer generates them in real time, delayed by at most
+ * sim_latency_ns, so the system load affects them like real IRQs.
+ */
+static void sensor_sim_frame(int sensor_index, ktime_t start, int type)
+{
+	struct dht22_sim_timer *sim = &sim_timers[sensor_index];
+	unsigned int noise = READ_ONCE(sim_noise_ns);
+	int temperature = READ_ONCE(sim_temperature);
+	int humidity = READ_ONCE(sim_humidity);
+	int edges = 2 + 5*8;
+	ktime_t *times = sim->edges;
+	ktime_t edge;
+	u8 bytes[5];
+	int i;
+
+	if (type == DHT22M_TYPE_DHT11) {
+		bytes[0] = humidity / 10;
+		bytes[1] = humidity % 10;
+		bytes[2] = abs(temperature) / 10;
+		bytes[3] = abs(temperature) % 10;
+		if (temperature < 0)
+			bytes[3] |= 0x80;
+	} else {
+		bytes[0] = humidity >> 8;
+		bytes[1] = humidity & 0xff;
+		bytes[2] = (abs(temperature) >> 8) & 0x7f;
+		if (temperature < 0)
+			bytes[2] |= 0x80;
+		bytes[3] = abs(temperature) & 0xff;
+	}
+	bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+
+	if (get_random_u32() % 1000 < READ_ONCE(sim_fail_rate)) {
+		if (get_random_u32() & 1)
+			bytes[get_random_u32() % 5] ^= 1 << (get_random_u32() % 8);
+		else
+			edges = get_random_u32() % edges;
+	}
+
+	/* A previous timed frame may still be running */
+	hrtimer_cancel(&sim->timer);
+
+	/* Start pulse, 30 µs response delay, 80 µs low and 80 µs high */
+	edge = ktime_add_us(start, dht22m_type_start_us(type) + 30);
+	for (i = 0; i < edges; i++) {
+		if (i == 1)
+			edge = ktime_add_us(edge, 80 + 80);
+		else if (i > 1)
+			edge = ktime_add_us(edge, (bytes[(i - 2) / 8] &
+					   (0x80 >> ((i - 2) & 7))) ? 50 + 70 : 50 + 26);
+		times[i] = edge;
+		if (noise)
+			times[i] += get_random_u32() % (2 * noise + 1);
+		times[i] -= noise;
+	}
+
+	if (!READ_ONCE(sim_timed)) {
+		for (i = 0; i < edges; i++)
+			sensor_stats_edge(sim->state,
+					  sensor_record_edge(sim->state, times[i]), 0);
+		return;
+	}
+	if (edges == 0)
+		return;
+	sim->next = 0;
+	sim->count = edges;
+	hrtimer_start(&sim->timer, ktime_add_ns(times[0], sim_edge_latency()),
+		      HRTIMER_MODE_ABS_HARD);
+}
+
+/* sensor_gpio_set() - Set the level of a sensor line, on sleeping controllers too */
+static void sensor_gpio_set(int gpio, bool cansleep, int value)
+{
+	if (cansleep)
+		gpio_set_value_cansleep(gpio, value);
+	else
+		gpio_set_value(gpio, value);
+}
+
+/* sensor_gpio_get() - Level of a sensor line, on sleeping controllers too */
+static int sensor_gpio_get(int gpio, bool cansleep)
+{
+	return cansleep ? gpio_get_value_cansleep(gpio) : gpio_get_value(gpio);
+}
+
+/*
+ * sensor_start_wait() - Wait while the start signal is sent.
+ * @start_us: Length of the start signal.
+ *
+ * The short signals are busy waited, the long ones (DHT11) are slept:
+ * they only have a minimum length.
+ *
+ * Return: True if the CPU was busy waiting.
+ */
+static bool sensor_start_wait(unsigned int start_us)
+{
+	if (start_us > DHT22M_START_SLEEP_US) {
+		usleep_range(start_us, start_us + 1000);
+		return false;
+	}
+	udelay(start_us);
+	return true;
+}
+
+/*
+ * mux_select() - Switch the multiplexers to a channel.
+ * @channel: The channel, its bits are set on the select gpios.
+ *
+ * Waits until the multiplexers and the pull-ups of the data lines settle.
+ */
+static void mux_select(int channel)
+{
+	int i;
+
+	if (simulate || num_mux_selects == 0)
+		return;
+	for (i = 0; i < num_mux_selects; i++)
+		sensor_gpio_set(mux_select_pins[i], mux_select_cansleep[i],
+				(channel >> i) & 1);
+	udelay(DHT22M_MUX_SETTLE_US);
+}
+
+/*
+ * sensor_start_read() - reading data from the DHT22 sensor.
+ * @sensor_index: Index of the sensor in gpio_pins, sensor_state, sensor_irqs arrays.
+ *
+ * The protocol for starting a sensor read is to first pull the GPIO pin
+ * low for at least 1ms (we pull it low for 1.5ms) and then pull the pin
+ * high and wait for the sensor to respond with an 80µs low pulse followed
+ * by an 80µs high pulse. After that initial response, the sensor sends 40
+ * pulses whose widths encode the actual sensor data. The pulses are
+ * recorded by our interrupt handler; we simply wait for 10ms so that the
+ * read cycle finishes and then process the data in sensor_state. The
+ * pulses are collected by an interrupt on falling edge on the GPIO pin.
+ *
+ * The configuration is looked up in the published sensor_config, the
+ * gpios of the sensor are not freed until the start signal is sent.
+ * Concurrent readers of the sensor are excluded by its readstate.
+ *
+ * Return: 0 on success; -EBUSY or -EIO on error; -ENXIO if the sensor is
+ * not configured (also while a reconfiguration runs).
+ */
+static int sensor_start_read(int sensor_index)
+{
+	struct dht22_state *state = &sensor_state[sensor_index];
+	struct dht22_cpu_cost cost = { 0 };
+	const ktime_t now = ktime_get();
+	struct dht22_config *config;
+	s64 timestamp_diff;
+	unsigned int wait_ms;
+	unsigned long flags;
+	int srcu_idx, gpio, type;
+	bool cansleep, busy;
+
+	srcu_idx = srcu_read_lock(&config_srcu);
+	config = srcu_dereference(sensor_config, &config_srcu);
+	sensor_lock_irqsave(state, flags);
+
+	if (state->readstate != DTH22M_READSTATE_NEXT) {
+		raw_spin_unlock_irqrestore(&state->lock, flags);
+		srcu_read_unlock(&config_srcu, srcu_idx);
+		return -EBUSY;
+	}
+
+	if (!config || sensor_index >= config->num_gpios ||
+	    config->sensor_states[sensor_index] != DHT22M_STATES_CONFIGURED) {
+		sensor_set_readstate(state, DTH22M_READSTATE_OTHERR);
+		raw_spin_unlock_irqrestore(&state->lock, flags);
+		srcu_read_unlock(&config_srcu, srcu_idx);
+		return -ENXIO;
+	}
+	gpio = config->gpio_pins[sensor_index];
+	cansleep = config->sensor_cansleep[sensor_index];
+	type = READ_ONCE(sensor_types[sensor_index]);
+
+	timestamp_diff = ktime_to_ms(now - state->read_timestamp);
+	wait_ms = sensor_min_interval_ms(sensor_index);
+	if (state->gpio == gpio &&
+	    wait_ms && timestamp_diff < wait_ms) {
+		sensor_set_readstate(state, DTH22M_READSTATE_TOOSOON);
+		raw_spin_unlock_irqrestore(&state->lock, flags);
+		srcu_read_unlock(&config_srcu, srcu_idx);
+		return -EBUSY;
+	}
+
+	state->gpio = gpio;
+	state->type = type;
+	sensor_set_readstate(state, DTH22M_READSTATE_COLLECT);
+	state->negative = false;
+	state->temperature = 0;
+	state->humidity = 0;
+	state->start = now;
+	state->last_edge = now;
+	state->start_end = now;
+	state->num_edges = 1;
+	raw_spin_unlock_irqrestore(&state->lock, flags);
+
+	if (simulate) {
+		/* The slept start signals delay the frame as on the wire */
+		if (dht22m_type_start_us(type) > DHT22M_START_SLEEP_US)
+			sensor_start_wait(dht22m_type_start_us(type));
+		sensor_sim_frame(sensor_index, now, type);
+		srcu_read_unlock(&config_srcu, srcu_idx);
+		return 0;
+	}
+
+	/* The edges of a multiplexed data line belong to this sensor now */
+	if (config->sensor_channels[sensor_index] >= 0)
+		WRITE_ONCE(mux_active[config->sensor_lines[sensor_index]], state);
+
+	/* We send the low signal to start the reading process */
+	if (gpio_direction_output(gpio, 0)) {
+		printk(KERN_ALERT DHT22M_MODULE_NAME
+		       ": gpio_direction_output failed\n");
+		goto start_seq_error;
+	}
+	busy = sensor_start_wait(dht22m_type_start_us(type));
+	sensor_gpio_set(gpio, cansleep, 1);
+
+	/* End of active send, start collecting data */
+	if (gpio_direction_input(gpio)) {
+		printk(KERN_ALERT DHT22M_MODULE_NAME
+		       ": gpio_direction_input failed\n");
+		goto start_seq_error;
+	}
+	sensor_lock_irqsave(state, flags);
+	state->start_end = ktime_get();
+	timestamp_diff = ktime_to_ns(ktime_sub(state->start_end, now));
+	raw_spin_unlock_irqrestore(&state->lock, flags);
+	sensor_latency_record(sensor_index, DHT22M_PHASE_START, timestamp_diff);
+	if (busy)
+		cost.busywait_ns = timestamp_diff;
+	sensor_cpu_account(sensor_index, &cost);
+	srcu_read_unlock(&config_srcu, srcu_idx);
+	return 0;
+
+start_seq_error:
+	sensor_lock_irqsave(state, flags);
+	sensor_set_readstate(state, DTH22M_READSTATE_OTHERR);
+	raw_spin_unlock_irqrestore(&state->lock, flags);
+	srcu_read_unlock(&config_srcu, srcu_idx);
+	return -EIO;
+}
+
+/*
+ * sensor_decode_pulses() - decode pulse widths and validate checksum.
+ * @state: The sensor state holding the recorded timestamps.
+ *
+ * May only be called when holding state->lock if state is a sensor_state.
+ *
+ * Translates pulse widths into bit values; stores the result in state.
+ * Validates the checksum.
+ *
+ * Return: 0 on success; -EIO on input error.
+ */
+static int sensor_decode_pulses(struct dht22_state *state)
+{
+	/*
+	 * The last falling edge which is the end of the start sequence occurs
+	 * at index 2 in the array of timestamps. Each falling edge after that
+	 * defines a pulse which encodes one bit: the periods are deltas[2..41].
+	 */
+	BUILD_BUG_ON(ARRAY_SIZE(state->deltas) < 5*8+2);
+	BUILD_BUG_ON(sizeof state->bytes < 5);
+	if (state->num_edges < 5*8+3) {
+		state->readstate = DTH22M_READSTATE_OTHERR;
+		return -EIO;
+	}
+	/* The bit decoding is shared with the userspace tools */
+	state->readstate = dht22m_decode_bits(&state->deltas[2], READ_ONCE(decoder),
+					      state->bytes);
+	return 0;
+}
+
+/*
+ * sensor_bit_error_ns() - Largest timing error of the bits of a frame.
+ * @state: The sensor state holding a complete decoded frame.
+ *
+ * Compares every bit period with the typical period of its decoded value
+ * (50 µs low, then 26 or 70 µs high). The difference is mostly the
+ * latency difference of the two edges of the period, so this shows how
+ * much timing margin is left for the decoder.
+ * May only be called when holding state->lock if state is a sensor_state.
+ *
+ * Return: The largest difference in nanoseconds.
+ */
+static u64 sensor_bit_error_ns(const struct dht22_state *state)
+{
+	s64 nominal, error;
+	u64 worst = 0;
+	int i;
+
+	for (i = 0; i < 5*8; i++) {
+		nominal = (state->bytes[i / 8] & (0x80 >> (i & 7))) ?
+			  (50 + 70) * NSEC_PER_USEC : (50 + 26) * NSEC_PER_USEC;
+		error = (s64)state->deltas[i + 2] - nominal;
+		worst = max_t(u64, worst, abs(error));
+	}
+	return worst;
+}
+
+/*
+ * sensor_parse_bytes() - parsing 4 byte data read from the sensor.
+ * @state: The sensor state holding the recorded timestamps.
+ *
+ * May only be called when holding state->lock if state is a sensor_state.
+ *
+ * Check that the right number of bits have been read and that the checksum is
+ * correct. If those checks pass, update read_timestamp, humidity and
+ * temperature fields in state with the newly read data.
+ *
+ * Return: 0 on success; -EIO on error.
+ */
+static int sensor_parse_bytes(struct dht22_state *state)
+{
+	int negative;
+
+	sensor_decode_pulses(state);
+	if (state->readstate != DTH22M_READSTATE_OK)
+		goto end_parse_bytes;
+	state->read_timestamp = state->last_edge;
+	/* The byte layout of the type is shared with the userspace tools */
+	dht22m_decode_values(state->type, state->bytes, &negative,
+			     &state->temperature, &state->humidity);
+	state->negative = negative;
+end_parse_bytes:
+	return 0;
+}
+
+/*
+ * sensor_frame_snapshot() - Save the edge timings of the finished read.
+ * @state: The state of the sensor.
+ * @frame: Destination frame.
+ *
+ * May only be called when holding state->lock.
+ */
+static void sensor_frame_snapshot(struct dht22_state *state,
+				  struct dht22m_frame *frame)
+{
+	memset(frame, 0, sizeof *frame);
+	frame->magic = DHT22M_FRAME_MAGIC;
+	frame->realtime_ns = ktime_get_real_ns();
+	frame->gpio = state->gpio;
+	if (simulate)
+		frame->flags = DHT22M_FRAME_FLAG_SIMULATED;
+	frame->readstate = state->readstate;
+	frame->num_edges = clamp(state->num_edges, 0, DHT22M_FRAME_EDGES);
+	memcpy(frame->bytes, state->bytes, sizeof frame->bytes);
+	frame->type = state->type;
+	if (frame->num_edges > 1)
+		memcpy(frame->deltas, state->deltas,
+		       (frame->num_edges - 1) * sizeof frame->deltas[0]);
+}
+
+/*
+ * sensor_failure_capture() - Store a failed frame in the failure ring.
+ * @sensor_index: Index of the sensor.
+ * @frame: The failed frame.
+ * @streamed: The frame is already captured by sensor_raw_capture().
+ */
+static void sensor_failure_capture(int sensor_index,
+				   const struct dht22m_frame *frame,
+				   bool streamed)
+{
+	struct dht22_failure_ring *ring = &failure_rings[sensor_index];
+	unsigned long flags;
+
+	spin_lock_irqsave(&failure_lock, flags);
+	ring->frames[ring->count % DHT22M_FAILURE_RING_SIZE] = *frame;
+	ring->streamed[ring->count % DHT22M_FAILURE_RING_SIZE] = streamed;
+	ring->count++;
+	spin_unlock_irqrestore(&failure_lock, flags);
+}
+
+/*
+ * sensor_raw_capture() - Pass a frame to the readers of the raw device.
+ * @sensor_index: Index of the sensor.
+ * @frame: The finished frame, its sequence number is set here.
+ */
+static void sensor_raw_capture(int sensor_index, struct dht22m_frame *frame)
+{
+	struct dht22_raw_ring *ring = &raw_rings[sensor_index];
+	unsigned long flags;
+
+	spin_lock_irqsave(&raw_lock, flags);
+	frame->sequence = ring->count;
+	ring->frames[ring->count % DHT22M_RAW_RING_SIZE] = *frame;
+	ring->count++;
+	spin_unlock_irqrestore(&raw_lock, flags);
+	wake_up_interruptible(&ring->wait);
+}
+
+/*
+ * sensor_failure_reset() - Drop the captured failures of all sensors.
+ * Called on (re)configuration with gpio_config_mutex held.
+ */
+static void sensor_failure_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&failure_lock, flags);
+	memset(failure_rings, 0, sizeof failure_rings);
+	spin_unlock_irqrestore(&failure_lock, flags);
+}
+
+/*
+ * sensor_probe_response() - Check that a sensor answers the start signal.
+ * @sensor_index: Index of the sensor in gpio_pins array.
+ *
+ * Cheap life sign check of a quarantined sensor: sends the start pulse and
+ * polls the line until the sensor pulls it low. The data transfer of the
+ * sensor is not collected and the IRQ of the sensor stays disabled.
+ * Too slow on sleeping controllers, not used for their sensors.
+ * Must be called when holding gpio_config_mutex.
+ *
+ * Return: true if the sensor responded.
+ */
+static bool sensor_probe_response(int sensor_index)
+{
+	int gpio = gpio_pins[sensor_index];
+	bool cansleep = sensor_cansleep[sensor_index];
+	ktime_t deadline;
+
+	if (simulate)
+		return true;
+	if (gpio_direction_output(gpio, 0))
+		return false;
+	sensor_start_wait(dht22m_type_start_us(READ_ONCE(sensor_types[sensor_index])));
+	sensor_gpio_set(gpio, cansleep, 1);
+	if (gpio_direction_input(gpio))
+		return false;
+
+	/* A line stuck at low level is not an answer */
+	if (sensor_gpio_get(gpio, cansleep) == 0)
+		return false;
+	deadline = ktime_add_us(ktime_get(), DHT22M_PROBE_RESPONSE_US);
+	while (ktime_before(ktime_get(), deadline)) {
+		if (sensor_gpio_get(gpio, cansleep) == 0)
+			return true;
+		udelay(2);
+	}
+	return false;
+}
+
+/*
+ * sensor_power_set() - Switch the power of a sensor with a power gpio.
+ * @sensor_index: Index of the sensor.
+ * @on: Power on (true) or off.
+ *
+ * While the power is off, the data line of a sensor with its own gpio is
+ * driven low too, otherwise the sensor would get power through the
+ * pull-up of the data line. (The data line of a multiplexer is left
+ * alone, the other channels use it.)
+ * May only be called when holding gpio_config_mutex.
+ */
+static void sensor_power_set(int sensor_index, bool on)
+{
+	int gpio = gpio_pins[sensor_index];
+
+	if (!simulate) {
+		if (!on && sensor_channels[sensor_index] < 0)
+			gpio_direction_output(gpio, 0);
+		sensor_gpio_set(power_pins[sensor_index],
+				power_cansleep[sensor_index], on);
+		if (on && sensor_channels[sensor_index] < 0)
+			gpio_direction_input(gpio);
+	}
+	sensor_health[sensor_index].powered_off = !on;
+}
+
+/*
+ * sensor_quarantine_release() - Let a quarantined sensor be read again.
+ * @sensor_index: Index of the sensor.
+ * @wait_ms: Time until the next read.
+ *
+ * May only be called when holding gpio_config_mutex.
+ */
+static void sensor_quarantine_release(int sensor_index, unsigned int wait_ms)
+{
+	struct dht22_health *health = &sensor_health[sensor_index];
+	unsigned long flags;
+
+	spin_lock_irqsave(&health_lock, flags);
+	/* One more failure puts the sensor back to quarantine */
+	health->state = DHT22M_HEALTH_BACKOFF;
+	health->consecutive_failures = max(READ_ONCE(quarantine_failures), 1U) - 1;
+	health->next_allowed = ktime_add_ms(ktime_get(), wait_ms);
+	health->trial_read = true;
+	spin_unlock_irqrestore(&health_lock, flags);
+	if (health->irq_disabled) {
+		enable_irq(sensor_irqs[sensor_index]);
+		health->irq_disabled = false;
+	}
+}
+
+/*
+ * sensor_health_admit() - Decide whether a read may be started on a sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * Reads are refused while the backoff of a failing sensor is running and
+ * while the sensor is in quarantine. A quarantined sensor is probed
+ * (if the probe interval elapsed) and released on response; the released
+ * sensor is readable after the normal wait time.
+ * A sensor with a power gpio which does not respond is switched off for
+ * DHT22M_POWER_OFF_MS; then it is switched on and released, the next
+ * read starts after its DHT22M_POWER_UP_MS start-up time.
+ *
+ * A gpio read of a sleeping controller (I2C/SPI expander) takes ~100 µs,
+ * so polling would miss the 80 µs response and fail the probe of a good
+ * sensor. These sensors are released for a trial read captured by the
+ * IRQ instead: one failure puts them back into quarantine. A sensor with
+ * a power gpio which failed its trial read is power cycled.
+ *
+ * Return: 0 if the read can start; -EAGAIN on backoff, -ENODEV on quarantine.
+ */
+static int sensor_health_admit(int sensor_index)
+{
+	struct dht22_health *health = &sensor_health[sensor_index];
+	struct dht22_cpu_cost cost = { 0 };
+	const ktime_t now = ktime_get();
+	ktime_t probe_start;
+	unsigned long flags;
+	bool responded;
+	int state;
+
+	spin_lock_irqsave(&health_lock, flags);
+	state = health->state;
+	if (ktime_before(now, health->next_allowed)) {
+		spin_unlock_irqrestore(&health_lock, flags);
+		return state == DHT22M_HEALTH_QUARANTINED ? -ENODEV : -EAGAIN;
+	}
+	if (state != DHT22M_HEALTH_QUARANTINED) {
+		spin_unlock_irqrestore(&health_lock, flags);
+		return 0;
+	}
+	/* Probe time: only one caller may do it */
+	health->next_allowed = ktime_add_ms(now, READ_ONCE(probe_interval_ms));
+	spin_unlock_irqrestore(&health_lock, flags);
+
+	config_mutex_lock();
+	if (sensor_states[sensor_index] != DHT22M_STATES_CONFIGURED) {
+		mutex_unlock(&gpio_config_mutex);
+		return -ENODEV;
+	}
+	if (health->powered_off) {
+		/* The power cycle is over, wait for the start-up of the sensor */
+		sensor_power_set(sensor_index, true);
+		sensor_quarantine_release(sensor_index,
+				max_t(unsigned int, DHT22M_POWER_UP_MS,
+				      sensor_min_interval_ms(sensor_index)));
+		printk(KERN_INFO DHT22M_MODULE_NAME
+		       ": GPIO %d powered on, quarantine released\n",
+		       gpio_pins[sensor_index]);
+		mutex_unlock(&gpio_config_mutex);
+		return -ENODEV;
+	}
+	if (sensor_cansleep[sensor_index]) {
+		spin_lock_irqsave(&health_lock, flags);
+		responded = !(health->trial_read && power_configured[sensor_index]);
+		health->trial_read = false;
+		spin_unlock_irqrestore(&health_lock, flags);
+	} else {
+		probe_start = ktime_get();
+		responded = sensor_probe_response(sensor_index);
+		if (!simulate) {
+			cost.busywait_ns = ktime_to_ns(ktime_sub(ktime_get(),
+								 probe_start));
+			sensor_cpu_account(sensor_index, &cost);
+		}
+	}
+	if (responded) {
+		sensor_quarantine_release(sensor_index,
+					  sensor_min_interval_ms(sensor_index));
+		printk(KERN_INFO DHT22M_MODULE_NAME
+		       ": GPIO %d %s, quarantine released\n",
+		       gpio_pins[sensor_index], sensor_cansleep[sensor_index] ?
+		       "on a sleeping controller" : "responded");
+	} else if (power_configured[sensor_index]) {
+		sensor_power_set(sensor_index, false);
+		spin_lock_irqsave(&health_lock, flags);
+		health->power_cycles++;
+		health->next_allowed = ktime_add_ms(ktime_get(), DHT22M_POWER_OFF_MS);
+		spin_unlock_irqrestore(&health_lock, flags);
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": GPIO %d does not respond, power cycling the sensor\n",
+		       gpio_pins[sensor_index]);
+	}
+	mutex_unlock(&gpio_config_mutex);
+	return -ENODEV;
+}
+
+/*
+ * sensor_health_update() - Account the result of a finished read.
+ * @sensor_index: Index of the sensor.
+ * @readstate: The DTH22M_READSTATE_* result of the read.
+ *
+ * Updates the failure counters and the error rate, computes the backoff
+ * of the next read and puts the sensor into quarantine if it failed
+ * too many times in a row.
+ */
+static void sensor_health_update(int sensor_index, int readstate)
+{
+	struct dht22_health *health = &sensor_health[sensor_index];
+	const ktime_t now = ktime_get();
+	bool failed = readstate != DTH22M_READSTATE_OK;
+	bool quarantine = false;
+	unsigned int shift, limit;
+	unsigned long flags;
+
+	spin_lock_irqsave(&health_lock, flags);
+	health->reads++;
+	health->error_ewma -= health->error_ewma >> DHT22M_EWMA_WEIGHT_SHIFT;
+	if (!failed) {
+		health->state = DHT22M_HEALTH_OK;
+		health->trial_read = false;
+		health->consecutive_failures = 0;
+		health->next_allowed = 0;
+		spin_unlock_irqrestore(&health_lock, flags);
+		return;
+	}
+	health->error_ewma += (1 << DHT22M_EWMA_SCALE_SHIFT) >> DHT22M_EWMA_WEIGHT_SHIFT;
+	health->failures++;
+	health->consecutive_failures++;
+	limit = READ_ONCE(quarantine_failures);
+	if (limit && health->consecutive_failures >= limit) {
+		health->state = DHT22M_HEALTH_QUARANTINED;
+		/* A sensor with power control is probed (and cycled) at once */
+		health->next_allowed = READ_ONCE(power_configured[sensor_index]) ? now :
+				ktime_add_ms(now, READ_ONCE(probe_interval_ms));
+		health->quarantines++;
+		quarantine = true;
+	} else {
+		shift = min(health->consecutive_failures - 1,
+			    (unsigned int)DHT22M_BACKOFF_MAX_SHIFT);
+		health->state = DHT22M_HEALTH_BACKOFF;
+		health->next_allowed = ktime_add_ms(now,
+				(s64)sensor_min_interval_ms(sensor_index) << shift);
+	}
+	spin_unlock_irqrestore(&health_lock, flags);
+
+	if (!quarantine)
+		return;
+	config_mutex_lock();
+	if (sensor_states[sensor_index] == DHT22M_STATES_CONFIGURED &&
+	    !health->irq_disabled) {
+		/* The IRQ of a multiplexed line is used by the other channels */
+		if (!simulate && sensor_channels[sensor_index] < 0) {
+			disable_irq(sensor_irqs[sensor_index]);
+			health->irq_disabled = true;
+		}
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": GPIO %d failed %u times, sensor quarantined\n",
+		       gpio_pins[sensor_index], limit);
+	}
+	mutex_unlock(&gpio_config_mutex);
+}
+
+/*
+ * sensor_health_reset() - Forget the health history of all sensors.
+ * Called on (re)configuration with gpio_config_mutex held.
+ */
+static void sensor_health_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&health_lock, flags);
+	memset(sensor_health, 0, sizeof sensor_health);
+	spin_unlock_irqrestore(&health_lock, flags);
+}
+
+/*
+ * sensor_latency_reset() - Clear the latency histograms of all sensors.
+ * Called on (re)configuration with gpio_config_mutex held.
+ */
+static void sensor_latency_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&latency_lock, flags);
+	memset(sensor_latency, 0, sizeof sensor_latency);
+	spin_unlock_irqrestore(&latency_lock, flags);
+}
+
+/*
+ * sensor_sample_update() - Store the result of a finished read.
+ * @sensor_index: Index of the sensor.
+ * @readstate: Result of the read.
+ * @negative: Sign of the temperature.
+ * @temperature: Temperature (times ten), only used if the read succeeded.
+ * @humidity: Humidity (times ten), only used if the read succeeded.
+ */
+static void sensor_sample_update(int sensor_index, int readstate, bool negative,
+				 int temperature, int humidity)
+{
+	struct dht22_sample_record *record = &sensor_samples[sensor_index];
+	const ktime_t now = ktime_get();
+	struct dht22_sample sample;
+
+	/* Only one writer can change the sample, no retry needed here */
+	spin_lock(&sample_lock);
+	sample = record->sample;
+	sample.readstate = readstate;
+	sample.read_time = now;
+	if (readstate == DTH22M_READSTATE_OK) {
+		sample.valid = true;
+		sample.negative = negative;
+		sample.temperature = temperature;
+		sample.humidity = humidity;
+		sample.sample_time = now;
+	}
+	write_seqcount_begin(&record->seq);
+	record->sample = sample;
+	write_seqcount_end(&record->seq);
+	spin_unlock(&sample_lock);
+}
+
+/*
+ * sensor_sample_copy() - Consistent copy of the published sample of a sensor.
+ * @sensor_index: Index of the sensor.
+ * @sample: Destination.
+ *
+ * Lockless: retries if a writer published a new sample during the copy.
+ */
+static void sensor_sample_copy(int sensor_index, struct dht22_sample *sample)
+{
+	struct dht22_sample_record *record = &sensor_samples[sensor_index];
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&record->seq);
+		*sample = record->sample;
+	} while (read_seqcount_retry(&record->seq, seq));
+}
+
+/*
+ * sensor_sample_reset() - Forget the cached samples of all sensors.
+ * Called on (re)configuration with gpio_config_mutex held.
+ */
+static void sensor_sample_reset(void)
+{
+	struct dht22_sample_record *record;
+	int i;
+
+	spin_lock(&sample_lock);
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++) {
+		record = &sensor_samples[i];
+		write_seqcount_begin(&record->seq);
+		memset(&record->sample, 0, sizeof record->sample);
+		record->sample.readstate = DTH22M_READSTATE_NEXT;
+		write_seqcount_end(&record->seq);
+	}
+	spin_unlock(&sample_lock);
+}
+
+/*
+ * sensor_gpio_name() - Name of a sensor as in gpiolist: "gpio" or "gpio/channel"
+ *
+ * Return: The length of the name.
+ */
+static int sensor_gpio_name(char *buf, size_t size, int gpio, int channel)
+{
+	if (channel < 0)
+		return scnprintf(buf, size, "%d", gpio);
+	return scnprintf(buf, size, "%d/%d", gpio, channel);
+}
+
+/*
+ * sensor_line_owner() - The first sensor on the data line of a sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * The sensors behind a multiplexer share its data gpio, only the first
+ * configured one of them requests the gpio and the IRQ. The sensors
+ * before sensor_index are already configured (or rejected, then they
+ * are skipped).
+ * May only be called when holding gpio_config_mutex.
+ *
+ * Return: Index of the first configured sensor with the same gpio
+ * (sensor_index if there is none); -EBUSY if the gpio is used without a
+ * multiplexer or the channel is used twice.
+ */
+static int sensor_line_owner(int sensor_index)
+{
+	int i, owner = sensor_index;
+
+	for (i = sensor_index - 1; i >= 0; i--) {
+		if (gpio_pins[i] != gpio_pins[sensor_index] ||
+		    sensor_states[i] != DHT22M_STATES_CONFIGURED)
+			continue;
+		if (sensor_channels[i] < 0 || sensor_channels[sensor_index] < 0 ||
+		    sensor_channels[i] == sensor_channels[sensor_index])
+			return -EBUSY;
+		owner = i;
+	}
+	return owner;
+}
+
+/*
+ * sensor_power_request() - Request the power gpio of a configured sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * The sensor is switched on and its first read waits for its start-up.
+ * If the gpio is not usable (or used by an other sensor), the sensor
+ * works without power control.
+ * May only be called when holding gpio_config_mutex.
+ */
+static void sensor_power_request(int sensor_index)
+{
+	int i, power = power_pins[sensor_index];
+	unsigned long flags;
+
+	if (power < 0)
+		return;
+	for (i = 0; i < sensor_index; i++)
+		if (power_configured[i] && power_pins[i] == power)
+			goto power_failed;
+	if (!simulate) {
+		if (!gpio_is_valid(power) ||
+		    gpio_request(power, DHT22M_MODULE_NAME "-power") < 0)
+			goto power_failed;
+		if (gpio_direction_output(power, 1)) {
+			gpio_free(power);
+			goto power_failed;
+		}
+		power_cansleep[sensor_index] = gpio_cansleep(power);
+	}
+	power_configured[sensor_index] = true;
+	spin_lock_irqsave(&health_lock, flags);
+	sensor_health[sensor_index].next_allowed =
+		ktime_add_ms(ktime_get(), DHT22M_POWER_UP_MS);
+	spin_unlock_irqrestore(&health_lock, flags);
+	return;
+
+power_failed:
+	printk(KERN_ALERT DHT22M_MODULE_NAME
+	       ": power GPIO %d is not usable, no power control on GPIO %d\n",
+	       power, gpio_pins[sensor_index]);
+}
+
+/*
+ * configure_gpios() - Configure the gpios according to the gpio_pins array
+ *
+ * Configure GPIOs from the gpio_pins array
+ * Check gpio value, set pin, request IRQs
+ * If a configuration success, the appropriate value of sensor_states
+ * set to DHT22M_STATES_CONFIGURED. Other values means errors and
+ * block the read from sensor.
+ * The sensors behind a multiplexer share the gpio and the IRQ requested
+ * for the first sensor of the data line.
+ */
+static int configure_gpios(void)
+{
+	char name[16];
+	int i, line, error;
+
+	printk(KERN_INFO DHT22M_MODULE_NAME ": configure sensors gpios\n");
+	sensor_health_reset();
+	sensor_failure_reset();
+	sensor_latency_reset();
+	sensor_stats_reset();
+	sensor_sample_reset();
+	for (i = 0; i < num_gpios; ++i) {
+		sensor_cansleep[i] = false;
+		sensor_lines[i] = i;
+		sensor_gpio_name(name, sizeof name, gpio_pins[i], sensor_channels[i]);
+		if (sensor_channels[i] >= (1 << num_mux_selects)) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+			       ": GPIO %s: no such multiplexer channel\n", name);
+			sensor_states[i] = DHT22M_STATES_GPIOERROR;
+			continue;
+		}
+		if (simulate) {
+			/* The gpio numbers are only labels of the sensors */
+			sensor_irqs[i] = -1;
+			sensor_states[i] = DHT22M_STATES_CONFIGURED;
+			sensor_power_request(i);
+			continue;
+		}
+		if (!gpio_is_valid(gpio_pins[i])) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME ": invalid GPIO pin\n");
+			sensor_states[i] = DHT22M_STATES_GPIOERROR;
+			continue;
+		}
+
+		line = sensor_line_owner(i);
+		if (line < 0) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+			       ": GPIO %s is used twice\n", name);
+			sensor_states[i] = DHT22M_STATES_GPIOERROR;
+			continue;
+		}
+		if (line != i) {
+			/* Another channel of a configured data line */
+			sensor_lines[i] = line;
+			sensor_irqs[i] = sensor_irqs[line];
+			sensor_cansleep[i] = sensor_cansleep[line];
+			sensor_states[i] = DHT22M_STATES_CONFIGURED;
+			sensor_power_request(i);
+			printk(KERN_INFO DHT22M_MODULE_NAME
+			       ": GPIO %s configured (IRQ %d shared)\n",
+			       name, sensor_irqs[i]);
+			continue;
+		}
+
+		if (gpio_request(gpio_pins[i], DHT22M_MODULE_NAME) < 0) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME ": gpio_request failed\n");
+			sensor_states[i] = DHT22M_STATES_GPIOERROR;
+			continue;
+		}
+
+		if (gpio_direction_input(gpio_pins[i])) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+				": initial gpio_direction_input failed\n");
+			gpio_free(gpio_pins[i]);
+			sensor_states[i] = DHT22M_STATES_GPIOERROR;
+			continue;
+		}
+
+		if ((sensor_irqs[i] = gpio_to_irq(gpio_pins[i])) < 0) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME ": gpio_to_irq failed\n");
+			gpio_free(gpio_pins[i]);
+			sensor_states[i] = DHT22M_STATES_IRQERROR;
+			continue;
+		}
+
+		/*
+		 * The IRQs of sleeping controllers (I2C/SPI expanders) are
+		 * nested into the IRQ thread of the controller, they need a
+		 * threaded handler. The timestamps are taken after the
+		 * controller read its status over the bus.
+		 *
+		 * On PREEMPT_RT the handlers are forced into threads unless
+		 * IRQF_NO_THREAD is given, then the timestamps are taken after
+		 * a scheduler hop. s_handle_edge() only takes the timestamp
+		 * under a raw spinlock, the decoding is done by the
+		 * acquisition thread, so it may run in hard IRQ context.
+		 */
+		sensor_cansleep[i] = gpio_cansleep(gpio_pins[i]);
+		mux_active[i] = &sensor_state[i];
+		if (sensor_cansleep[i])
+			error = request_threaded_irq(sensor_irqs[i], NULL,
+					sensor_channels[i] >= 0 ?
+					s_handle_mux_edge : s_handle_edge,
+					IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+					DHT22M_MODULE_NAME, sensor_irq_dev_id(i));
+		else
+			error = request_irq(sensor_irqs[i],
+					sensor_channels[i] >= 0 ?
+					s_handle_mux_edge : s_handle_edge,
+					IRQF_TRIGGER_FALLING |
+					(edge_irq_no_thread ? IRQF_NO_THREAD : 0),
+					DHT22M_MODULE_NAME, sensor_irq_dev_id(i));
+		if (error < 0) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME ": request_irq failed\n");
+			gpio_free(gpio_pins[i]);
+			sensor_cansleep[i] = false;
+			sensor_states[i] = DHT22M_STATES_IRQERROR;
+			continue;
+		}
+
+		sensor_states[i] = DHT22M_STATES_CONFIGURED;
+		sensor_power_request(i);
+		printk(KERN_INFO DHT22M_MODULE_NAME ": GPIO %s configured (IRQ %d%s)\n",
+		       name, sensor_irqs[i],
+		       sensor_cansleep[i] ? ", sleeping controller" :
+		       IS_ENABLED(CONFIG_PREEMPT_RT) && !edge_irq_no_thread ?
+		       ", threaded" : "");
+	}
+	return 0;
+}
+
+/*
+ * free_gpios() - Free all configured GPIOs and IRQs
+ */
+static void free_gpios(void)
+{
+	int i;
+
+	printk(KERN_INFO DHT22M_MODULE_NAME ": Free IRQ and GPIOs\n");
+	for (i = 0; i < DHT22M_MAX_DEVICES; ++i) {
+		if (power_configured[i]) {
+			/* Do not leave a sensor switched off by a power cycle */
+			if (sensor_health[i].powered_off)
+				sensor_power_set(i, true);
+			if (!simulate)
+				gpio_free(power_pins[i]);
+			power_configured[i] = false;
+		}
+		if (sensor_states[i] == DHT22M_STATES_CONFIGURED && simulate) {
+			sensor_states[i] = DHT22M_STATES_ZEROCONF;
+		} else if (sensor_states[i] == DHT22M_STATES_CONFIGURED) {
+			/*
+			printk(KERN_INFO DHT22M_MODULE_NAME
+			       ": Free IRQ %d and GPIO %d\n",sensor_irqs[i],gpio_pins[i]);
+			*/
+			if (sensor_health[i].irq_disabled) {
+				enable_irq(sensor_irqs[i]);
+				sensor_health[i].irq_disabled = false;
+			}
+			/* The first sensor of a data line owns the gpio and IRQ */
+			if (sensor_lines[i] == i) {
+				free_irq(sensor_irqs[i], sensor_irq_dev_id(i));
+				gpio_free(gpio_pins[i]);
+			}
+			sensor_states[i] = DHT22M_STATES_ZEROCONF;
+		}
+	}
+}
+
+/*
+ * dht22m_parse_sensor() - Parse one sensor of a gpio list
+ * @token: "gpio" or "gpio/channel" for a sensor behind a multiplexer,
+ *         optionally followed by ":power" with the power control gpio.
+ * @pin: The parsed gpio.
+ * @channel: The parsed channel, -1 if the token has none.
+ * @power: The parsed power gpio, -1 if the token has none.
+ *
+ * Return: True if the token is valid.
+ */
+static bool dht22m_parse_sensor(char *token, int *pin, int *channel, int *power)
+{
+	char *colon = strchr(token, ':');
+
+	*power = -1;
+	if (colon) {
+		*colon = '\0';
+		if (kstrtoint(colon + 1, 10, power) || *power < 0)
+			return false;
+	}
+	switch (sscanf(token, "%d/%d", pin, channel)) {
+	case 1:
+		*channel = -1;
+		return true;
+	case 2:
+		return *channel >= 0 && *channel < DHT22M_MUX_CHANNELS;
+	default:
+		return false;
+	}
+}
+
+/*
+ * dht22m_parse_gpios() - Parse a gpio list
+ * @buf: Gpio numbers separated by space, comma or semicolon.
+ *       A sensor behind a multiplexer is given as "gpio/channel".
+ * @pins: The parsed gpios (DHT22M_MAX_DEVICES long).
+ * @channels: The parsed channels, -1 without multiplexer (DHT22M_MAX_DEVICES long).
+ * @powers: The parsed power gpios, -1 without power control (DHT22M_MAX_DEVICES long).
+ *
+ * Parsing stops at the first bad data.
+ *
+ * Return: Number of the parsed gpios.
+ */
+static int dht22m_parse_gpios(const char *buf, int *pins, int *channels,
+			      int *powers)
+{
+	int full_length;
+	/* Up to 12 characters per sensor: "gpio/channel:power " */
+	char localbuf[DHT22M_MAX_DEVICES * 12];
+	char *runner;
+	int i,gpiovalue,channel,power;
+	int new_num_gpios = 0;
+
+	for(i = 0; i < DHT22M_MAX_DEVICES; ++i) {
+		pins[i] = 0;
+		channels[i] = -1;
+		powers[i] = -1;
+	}
+	strscpy(localbuf, buf, sizeof(localbuf));
+	full_length = strlen(localbuf);
+	runner = localbuf;
+	for(i = 0; i < full_length && new_num_gpios < DHT22M_MAX_DEVICES; ++i) {
+		if (localbuf[i] == ' ' || localbuf[i] == ';' || localbuf[i] == ',') {
+			localbuf[i] = '\0';
+			if(dht22m_parse_sensor(runner, &gpiovalue, &channel, &power)) {
+				pins[new_num_gpios] = gpiovalue;
+				channels[new_num_gpios] = channel;
+				powers[new_num_gpios] = power;
+				++new_num_gpios;
+				/* If we have more characters until the string end */
+				if (i + 1 < full_length) {
+					/* runner will points the next char
+					 * after the converted separator
+					 */
+					runner = localbuf + i + 1;
+					continue;
+				} else {
+					break; /* It was the last number */
+				}
+			} else {
+				break; /* Some bad data found */
+			}
+		}
+		if (i + 1 == full_length) {
+			if(dht22m_parse_sensor(runner, &gpiovalue, &channel, &power)) {
+				pins[new_num_gpios] = gpiovalue;
+				channels[new_num_gpios] = channel;
+				powers[new_num_gpios] = power;
+				++new_num_gpios;
+				break; /* It was the last number */
+			}
+		}
+	}
+
+	/* Only for debugging
+	for (i = 0; i < new_num_gpios; ++i)
+		printk(KERN_INFO DHT22M_MODULE_NAME
+		       ": About to set gpio %d to on pos %d\n",pins[i],i);
+	*/
+	return new_num_gpios;
+}
+
+/*
+ * mux_gpios_request() - Request the channel select gpios of mux_gpios
+ *
+ * The select gpios are set up once at load time. If one of them fails,
+ * no multiplexer is usable: the multiplexed sensors get a gpio error.
+ */
+static void mux_gpios_request(void)
+{
+	int pins[DHT22M_MAX_DEVICES], channels[DHT22M_MAX_DEVICES];
+	int powers[DHT22M_MAX_DEVICES];
+	int i, count;
+
+	count = dht22m_parse_gpios(mux_gpios, pins, channels, powers);
+	if (count > DHT22M_MUX_SELECTS) {
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": only %d multiplexer select gpios are used\n",
+		       DHT22M_MUX_SELECTS);
+		count = DHT22M_MUX_SELECTS;
+	}
+	for (i = 0; i < count; i++) {
+		mux_select_pins[i] = pins[i];
+		if (simulate)
+			continue;
+		if (!gpio_is_valid(pins[i]) ||
+		    gpio_request(pins[i], DHT22M_MODULE_NAME "-mux") < 0 ||
+		    gpio_direction_output(pins[i], 0)) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+			       ": multiplexer select GPIO %d failed\n", pins[i]);
+			if (gpio_is_valid(pins[i]))
+				gpio_free(pins[i]);
+			goto mux_failed;
+		}
+		mux_select_cansleep[i] = gpio_cansleep(pins[i]);
+	}
+	num_mux_selects = count;
+	if (count)
+		printk(KERN_INFO DHT22M_MODULE_NAME
+		       ": %d multiplexer channels\n", 1 << count);
+	return;
+
+mux_failed:
+	while (--i >= 0)
+		gpio_free(mux_select_pins[i]);
+}
+
+/* mux_gpios_free() - Free the channel select gpios */
+static void mux_gpios_free(void)
+{
+	int i;
+
+	if (!simulate)
+		for (i = 0; i < num_mux_selects; i++)
+			gpio_free(mux_select_pins[i]);
+	num_mux_selects = 0;
+}
+
+/*
+ * sensor_config_publish() - Publish the configuration to the read path
+ * @configured: Publish the current configuration (true) or no sensors.
+ *
+ * Waits until the readers of the previous configuration finish.
+ * May only be called when holding gpio_config_mutex.
+ */
+static void sensor_config_publish(bool configured)
+{
+	struct dht22_config *config = NULL, *old;
+
+	if (configured) {
+		config = kmalloc(sizeof *config, GFP_KERNEL);
+		if (config) {
+			config->num_gpios = num_gpios;
+			memcpy(config->gpio_pins, gpio_pins, sizeof gpio_pins);
+			memcpy(config->sensor_irqs, sensor_irqs, sizeof sensor_irqs);
+			memcpy(config->sensor_states, sensor_states,
+			       sizeof sensor_states);
+			memcpy(config->sensor_cansleep, sensor_cansleep,
+			       sizeof sensor_cansleep);
+			memcpy(config->sensor_channels, sensor_channels,
+			       sizeof sensor_channels);
+			memcpy(config->sensor_lines, sensor_lines,
+			       sizeof sensor_lines);
+		} else {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+			       ": no memory to publish the configuration\n");
+		}
+	}
+	old = rcu_dereference_protected(sensor_config,
+					lockdep_is_held(&gpio_config_mutex));
+	rcu_assign_pointer(sensor_config, config);
+	synchronize_srcu(&config_srcu);
+	kfree(old);
+}
+
+/*
+ * dht22m_set_gpios() - Reconfigure the sensors if the gpio list changed
+ * @new_gpio_pins: The new gpios (DHT22M_MAX_DEVICES long).
+ * @new_channels: The new multiplexer channels (DHT22M_MAX_DEVICES long).
+ * @new_powers: The new power gpios (DHT22M_MAX_DEVICES long).
+ * @new_num_gpios: Number of the new gpios.
+ *
+ * May only be called when holding gpio_config_mutex.
+ */
+static void dht22m_set_gpios(const int *new_gpio_pins, const int *new_channels,
+			     const int *new_powers, int new_num_gpios)
+{
+	int i;
+	char is_change;
+
+	is_change = 0;
+	for(i = 0; i < DHT22M_MAX_DEVICES; ++i)
+		if (gpio_pins[i] != new_gpio_pins[i] ||
+		    sensor_channels[i] != new_channels[i] ||
+		    power_pins[i] != new_powers[i]) {
+			is_change = 1;
+			break;
+		}
+	if(is_change) {
+		/* The running reads finish with the old gpios, new ones fail */
+		sensor_config_publish(false);
+		free_gpios();
+		remove_devices();
+
+		num_gpios = new_num_gpios;
+		for(i = 0; i < DHT22M_MAX_DEVICES; ++i) {
+			gpio_pins[i] = new_gpio_pins[i];
+			sensor_channels[i] = new_channels[i];
+			power_pins[i] = new_powers[i];
+		}
+
+		configure_gpios();
+		create_devices();
+		sensor_config_publish(true);
+		printk(KERN_INFO DHT22M_MODULE_NAME ": Conf req - %d GPIOs set. \n", num_gpios);
+	} else {
+		printk(KERN_INFO DHT22M_MODULE_NAME ": Conf req - GPIOs unchanged. \n");
+	}
+}
+
+/*
+ * dht22m_gpios_store() - Sysfs write handler, gpio config function
+ *
+ * Receices a string from the userspace through sysfs which contains the gpio numbers.
+ */
+static ssize_t dht22m_gpios_store(struct class *class,
+				  struct class_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int new_gpio_pins[DHT22M_MAX_DEVICES];
+	int new_channels[DHT22M_MAX_DEVICES];
+	int new_powers[DHT22M_MAX_DEVICES];
+	int new_num_gpios;
+
+	new_num_gpios = dht22m_parse_gpios(buf, new_gpio_pins, new_channels,
+					   new_powers);
+	config_mutex_lock();
+	dht22m_set_gpios(new_gpio_pins, new_channels, new_powers, new_num_gpios);
+	mutex_unlock(&gpio_config_mutex);
+	sensor_period_kick();
+	return count;
+}
+
+/*
+ * dht22m_gpios_show() -  Sysfs read handler: print the current configured gpios
+ */
+static ssize_t dht22m_gpios_show(struct class *class,
+				 struct class_attribute *attr, char *buf)
+{
+	int i;
+	int len = 0;
+
+	config_mutex_lock();
+	for (i = 0; i < num_gpios; ++i) {
+		if (i > 0) {
+			len += sprintf(buf + len, " ");
+		}
+		len += sensor_gpio_name(buf + len, PAGE_SIZE - len, gpio_pins[i],
+					sensor_channels[i]);
+		if (power_pins[i] >= 0)
+			len += sprintf(buf + len, ":%d", power_pins[i]);
+	}
+	mutex_unlock(&gpio_config_mutex);
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+
+/* Sysfs attribute for gpio set file "gpiolist" */
+static struct class_attribute dht22m_class_attr =
+	__ATTR(gpiolist, 0664, dht22m_gpios_show, dht22m_gpios_store);
+
+/*
+ * dht22m_health_copy() - Copy the health of the sensor behind a device
+ *
+ * The sensor index is stored as the driver data of the dht22mX devices.
+ */
+static void dht22m_health_copy(struct device *dev, struct dht22_health *health)
+{
+	int sensor_index = (long)dev_get_drvdata(dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&health_lock, flags);
+	*health = sensor_health[sensor_index];
+	spin_unlock_irqrestore(&health_lock, flags);
+}
+
+/* Sysfs read handler of "health": ok, backoff or quarantined */
+static ssize_t health_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	static const char * const names[] = { "ok", "backoff", "quarantined" };
+	struct dht22_health health;
+
+	dht22m_health_copy(dev, &health);
+	return sprintf(buf, "%s\n", names[health.state]);
+}
+
+/* Sysfs read handler of "consecutive_failures" */
+static ssize_t consecutive_failures_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct dht22_health health;
+
+	dht22m_health_copy(dev, &health);
+	return sprintf(buf, "%u\n", health.consecutive_failures);
+}
+
+/* Sysfs read handler of "error_rate": recent failure percentage */
+static ssize_t error_rate_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct dht22_health health;
+	unsigned int permille;
+
+	dht22m_health_copy(dev, &health);
+	permille = ((u64)health.error_ewma * 1000) >> DHT22M_EWMA_SCALE_SHIFT;
+	return sprintf(buf, "%u.%u\n", permille / 10, permille % 10);
+}
+
+/* Sysfs read handler of "failures": failed reads / all reads */
+static ssize_t failures_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct dht22_health health;
+
+	dht22m_health_copy(dev, &health);
+	return sprintf(buf, "%llu/%llu\n", health.failures, health.reads);
+}
+
+/* Sysfs read handler of "quarantines" */
+static ssize_t quarantines_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dht22_health health;
+
+	dht22m_health_copy(dev, &health);
+	return sprintf(buf, "%u\n", health.quarantines);
+}
+
+/*
+ * sensor_type_parse() - The sensor type of a name.
+ *
+ * Return: DHT22M_TYPE_* or -EINVAL if the name is unknown.
+ */
+static int sensor_type_parse(const char *name)
+{
+	int type;
+
+	for (type = 0; type < DHT22M_TYPES; type++)
+		if (sysfs_streq(name, dht22m_type_name(type)))
+			return type;
+	return -EINVAL;
+}
+
+/* Sysfs read handler of "type": dht22, dht11, am2301 or am2320 */
+static ssize_t type_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	int sensor_index = (long)dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n",
+		       dht22m_type_name(READ_ONCE(sensor_types[sensor_index])));
+}
+
+/* Sysfs write handler of "type": the next read uses the new type */
+static ssize_t type_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	int sensor_index = (long)dev_get_drvdata(dev);
+	int type = sensor_type_parse(buf);
+
+	if (type < 0)
+		return type;
+	WRITE_ONCE(sensor_types[sensor_index], type);
+	return count;
+}
+
+/* Sysfs read handler of "power_cycles" */
+static ssize_t power_cycles_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct dht22_health health;
+
+	dht22m_health_copy(dev, &health);
+	return sprintf(buf, "%u\n", health.power_cycles);
+}
+
+static DEVICE_ATTR_RO(health);
+static DEVICE_ATTR_RW(type);
+static DEVICE_ATTR_RO(consecutive_failures);
+static DEVICE_ATTR_RO(error_rate);
+static DEVICE_ATTR_RO(failures);
+static DEVICE_ATTR_RO(quarantines);
+static DEVICE_ATTR_RO(power_cycles);
+
+/* Sysfs attributes of the "dht22mX" devices */
+static struct attribute *dht22m_sensor_attrs[] = {
+	&dev_attr_health.attr,
+	&dev_attr_type.attr,
+	&dev_attr_consecutive_failures.attr,
+	&dev_attr_error_rate.attr,
+	&dev_attr_failures.attr,
+	&dev_attr_quarantines.attr,
+	&dev_attr_power_cycles.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(dht22m_sensor);
+
+/*
+ * sensor_read_start() - Start a read of a sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * The first half of a read, see acq_read_batch(). Checks the health of
+ * the sensor and sends the start signal.
+ *
+ * Only the gpio errors count as failures of the sensor: a sensor which
+ * is not configured (or under reconfiguration, -ENXIO) is not failing.
+ *
+ * Return: 0 if the read was started;
+ * -EBUSY, -EAGAIN, -ENODEV, -ENXIO or -EIO if the read could not be started.
+ */
+static int sensor_read_start(int sensor_index)
+{
+	struct dht22_state *state = &sensor_state[sensor_index];
+	unsigned long flags;
+	int error;
+
+	error = sensor_health_admit(sensor_index);
+	if (error == 0) {
+		error = sensor_start_read(sensor_index);
+		if (error != 0) {
+			sensor_lock_irqsave(state, flags);
+			sensor_set_readstate(state, DTH22M_READSTATE_NEXT);
+			raw_spin_unlock_irqrestore(&state->lock, flags);
+		}
+		if (error == -EIO)
+			sensor_health_update(sensor_index, DTH22M_READSTATE_OTHERR);
+		if (error == -EBUSY)
+			sensor_stats_add(sensors[sensor_index].busy_rejects, 1);
+	}
+	return error;
+}
+
+/*
+ * sensor_read_finish() - Finish a started read and store the result.
+ * @sensor_index: Index of the sensor.
+ * @read_start: Time when the read was requested: the first request of a
+ *              reader or the start of the batch of a periodic read.
+ * @result: The result of the read (readstate and the sample).
+ *
+ * The second half of a read, called after the frame is complete: decodes
+ * it and updates the captures, the health and the cached sample of the
+ * sensor.
+ */
+static void sensor_read_finish(int sensor_index, ktime_t read_start,
+			       struct dht22_sample *result)
+{
+	struct dht22_state *state = &sensor_state[sensor_index];
+	s64 response_ns = -1, transfer_ns = -1, bit_error_ns = -1;
+	ktime_t decode_start, deliver_start, bits_start;
+	struct dht22_cpu_cost cost = { 0 };
+	struct dht22m_frame frame;
+	unsigned long flags;
+	bool raw_capture;
+
+	/* Read sensor data (protected by state->lock) into the result. */
+	sensor_lock_irqsave(state, flags);
+	if (state->num_edges >= 3) {
+		/* The end of the sensor response, the first bit starts here */
+		bits_start = ktime_add_ns(state->start,
+					  (u64)state->deltas[0] + state->deltas[1]);
+		response_ns = ktime_to_ns(ktime_sub(bits_start, state->start_end));
+		if (state->num_edges >= DHT22M_FRAME_EDGES)
+			transfer_ns = ktime_to_ns(ktime_sub(state->last_edge,
+							    bits_start));
+	}
+	decode_start = ktime_get();
+	/* Account the collecting time before the decoder sets the result */
+	sensor_set_readstate(state, state->readstate);
+	sensor_parse_bytes(state);
+	deliver_start = ktime_get();
+	if (state->num_edges >= DHT22M_FRAME_EDGES &&
+	    (state->readstate == DTH22M_READSTATE_OK ||
+	     state->readstate == DTH22M_READSTATE_CHKSUMERR))
+		bit_error_ns = sensor_bit_error_ns(state);
+	result->readstate = state->readstate;
+	result->negative = state->negative;
+	result->temperature = state->temperature;
+	result->humidity = state->humidity;
+	raw_capture = atomic_read(&raw_rings[sensor_index].readers) > 0;
+	if (result->readstate != DTH22M_READSTATE_OK || raw_capture)
+		sensor_frame_snapshot(state, &frame);
+	sensor_set_readstate(state, DTH22M_READSTATE_NEXT);
+	raw_spin_unlock_irqrestore(&state->lock, flags);
+	/* Sensor lock released. */
+
+	if (response_ns >= 0)
+		sensor_latency_record(sensor_index, DHT22M_PHASE_RESPONSE, response_ns);
+	if (transfer_ns >= 0)
+		sensor_latency_record(sensor_index, DHT22M_PHASE_TRANSFER, transfer_ns);
+	if (bit_error_ns >= 0)
+		sensor_latency_record(sensor_index, DHT22M_PHASE_BIT_ERROR, bit_error_ns);
+	sensor_latency_record(sensor_index, DHT22M_PHASE_DECODE,
+			      ktime_to_ns(ktime_sub(deliver_start, decode_start)));
+	/* The raw capture numbers the frame, the failure keeps the number */
+	if (raw_capture)
+		sensor_raw_capture(sensor_index, &frame);
+	if (result->readstate != DTH22M_READSTATE_OK)
+		sensor_failure_capture(sensor_index, &frame, raw_capture);
+	sensor_health_update(sensor_index, result->readstate);
+	sensor_sample_update(sensor_index, result->readstate, result->negative,
+			     result->temperature, result->humidity);
+
+	sensor_stats_add(sensors[sensor_index].results[result->readstate], 1);
+	cost.decode_ns = ktime_to_ns(ktime_sub(deliver_start, decode_start));
+	cost.deliver_ns = ktime_to_ns(ktime_sub(ktime_get(), deliver_start));
+	sensor_cpu_account(sensor_index, &cost);
+	sensor_latency_record(sensor_index, DHT22M_PHASE_DELIVER, cost.deliver_ns);
+	sensor_latency_record(sensor_index, DHT22M_PHASE_TOTAL,
+			      ktime_to_ns(ktime_sub(ktime_get(), read_start)));
+}
+
+/*
+ * struct dht22_acq_request - A read requested from the acquisition thread.
+ * @node: Entry of acq_requests.
+ * @sensor_index: The sensor to read.
+ * @requested: Time when the request was queued.
+ * @error: 0 or the error of sensor_read_start().
+ * @result: The result of the read.
+ * @done: Completed by the thread when the result is ready.
+ */
+struct dht22_acq_request {
+	struct list_head node;
+	int sensor_index;
+	ktime_t requested;
+	int error;
+	struct dht22_sample result;
+	struct completion done;
+};
+
+/*
+ * The acquisition thread does all start signals and decoding, so the
+ * timing of the reads does not depend on the priority, the cgroup or the
+ * preemption of the reader process. Runs with acq_priority on acq_cpu.
+ * acq_thread may only be changed when holding the parameter lock
+ * (kernel_param_lock), so the parameter callbacks can use it.
+ */
+static struct task_struct *acq_thread;
+static DECLARE_WAIT_QUEUE_HEAD(acq_wait);
+
+/*
+ * acq_requests and acq_period_due may only be accessed when holding
+ * acq_lock.
+ */
+static LIST_HEAD(acq_requests);
+static bool acq_period_due;
+static DEFINE_SPINLOCK(acq_lock);  /* Protects acq_requests and acq_period_due. */
+
+/* The periodic reads may be (re)started: set after init, cleared on unload */
+static bool sensor_period_enabled;
+
+/*
+ * The CPU latency requests of the frames. acq_qos limits all CPUs,
+ * acq_irq_qos[i] only the CPU handling the IRQ of sensor i. They may
+ * only be used by the acquisition thread (and the init and cleanup).
+ */
+static struct pm_qos_request acq_qos;
+static struct dev_pm_qos_request acq_irq_qos[DHT22M_MAX_DEVICES];
+
+/*
+ * sensor_irq_cpu() - The CPU handling the IRQ of a sensor.
+ * @sensor_index: Index of the sensor.
+ *
+ * Return: The CPU or -1 if the IRQ is not bound to exactly one CPU.
+ */
+static int sensor_irq_cpu(int sensor_index)
+{
+	const struct cpumask *mask;
+	struct dht22_config *config;
+	int srcu_idx, irq = -1;
+
+	srcu_idx = srcu_read_lock(&config_srcu);
+	config = srcu_dereference(sensor_config, &config_srcu);
+	if (config && config->sensor_states[sensor_index] == DHT22M_STATES_CONFIGURED)
+		irq = config->sensor_irqs[sensor_index];
+	srcu_read_unlock(&config_srcu, srcu_idx);
+	if (irq < 0)
+		return -1;
+	mask = irq_get_effective_affinity_mask(irq);
+	if (!mask || cpumask_weight(mask) != 1)
+		return -1;
+	return cpumask_first(mask);
+}
+
+/*
+ * acq_qos_begin() - Keep the CPUs out of the deep idle states for the frames.
+ * @wanted: The sensors to be read.
+ *
+ * Deep idle states add wake-up latency to the edge IRQs and stretch the
+ * measured bit periods. The latency is limited to acq_qos_us only until
+ * acq_qos_end(), so the idle states are usable between the reads.
+ * With acq_qos_irq_cpu only the CPUs of the sensor IRQs are limited
+ * (all CPUs if the CPU of an IRQ is not known).
+ */
+static void acq_qos_begin(const bool *wanted)
+{
+	int latency_us = READ_ONCE(acq_qos_us);
+	bool irq_cpu = READ_ONCE(acq_qos_irq_cpu);
+	bool global = !irq_cpu;
+	struct device *dev;
+	int i, cpu;
+
+	if (latency_us < 0)
+		return;
+	for (i = 0; irq_cpu && i < DHT22M_MAX_DEVICES; i++) {
+		if (!wanted[i])
+			continue;
+		cpu = simulate ? -1 : sensor_irq_cpu(i);
+		dev = cpu >= 0 ? get_cpu_device(cpu) : NULL;
+		if (!dev || dev_pm_qos_add_request(dev, &acq_irq_qos[i],
+						   DEV_PM_QOS_RESUME_LATENCY,
+						   latency_us) < 0)
+			global = true;
+	}
+	if (global)
+		cpu_latency_qos_update_request(&acq_qos, latency_us);
+}
+
+/* acq_qos_end() - Release the latency limits of acq_qos_begin() */
+static void acq_qos_end(void)
+{
+	int i;
+
+	cpu_latency_qos_update_request(&acq_qos, PM_QOS_DEFAULT_VALUE);
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		if (dev_pm_qos_request_active(&acq_irq_qos[i]))
+			dev_pm_qos_remove_request(&acq_irq_qos[i]);
+}
+
+/*
+ * acq_frames_complete() - All started reads of a round have their frames.
+ * @round: The sensors of the round.
+ * @error: The errors of sensor_read_start().
+ */
+static bool acq_frames_complete(const bool *round, const int *error)
+{
+	struct dht22_state *state;
+	unsigned long flags;
+	bool complete = true;
+	int i;
+
+	for (i = 0; i < DHT22M_MAX_DEVICES && complete; i++) {
+		if (!round[i] || error[i] != 0)
+			continue;
+		state = &sensor_state[i];
+		sensor_lock_irqsave(state, flags);
+		complete = state->num_edges >= DHT22M_FRAME_EDGES;
+		raw_spin_unlock_irqrestore(&state->lock, flags);
+	}
+	return complete;
+}
+
+/*
+ * acq_read_round() - Read sensors at the same time.
+ * @channel: The multiplexer channel of the sensors (-1: no multiplexer).
+ * @round: The sensors to read.
+ * @read_start: The request times of the reads.
+ * @error: The errors of sensor_read_start().
+ * @results: The results of the started reads.
+ *
+ * Selects the channel, starts the reads of all sensors, sleeps once
+ * until the frames are complete, then decodes them. If a frame is not
+ * complete after DHT22M_FRAME_US (late edges under load, a failing
+ * sensor), the round waits up to DHT22M_FRAME_TIMEOUT_MS for it.
+ * The CPU latency is limited from the start signals to the end of the
+ * frames, see acq_qos_begin().
+ */
+static void acq_read_round(int channel, const bool *round,
+			   const ktime_t *read_start, int *error,
+			   struct dht22_sample *results)
+{
+	bool started = false;
+	ktime_t sleep_start;
+	s64 oversleep_ns, wait_ns, queue_ns;
+	int i;
+
+	acq_qos_begin(round);
+	if (channel >= 0)
+		mux_select(channel);
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++) {
+		if (!round[i])
+			continue;
+		/* The earlier rounds and start signals are waited here too */
+		queue_ns = ktime_to_ns(ktime_sub(ktime_get(), read_start[i]));
+		error[i] = sensor_read_start(i);
+		if (error[i] == 0) {
+			sensor_latency_record(i, DHT22M_PHASE_QUEUE, queue_ns);
+			started = true;
+		}
+	}
+
+	if (started && (!simulate || READ_ONCE(sim_timed))) {
+		sleep_start = ktime_get();
+		/* Read cycle takes less than 6ms, then the CPUs may sleep deeper */
+		usleep_range(DHT22M_FRAME_US, DHT22M_FRAME_US + 500);
+		acq_qos_end();
+		wait_ns = DHT22M_FRAME_US * NSEC_PER_USEC;
+		if (!acq_frames_complete(round, error)) {
+			msleep(DHT22M_FRAME_TIMEOUT_MS - DHT22M_FRAME_US / USEC_PER_MSEC);
+			wait_ns = DHT22M_FRAME_TIMEOUT_MS * NSEC_PER_MSEC;
+		}
+		oversleep_ns = ktime_to_ns(ktime_sub(ktime_get(), sleep_start)) -
+			       wait_ns;
+		for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+			if (round[i] && error[i] == 0)
+				sensor_latency_record(i, DHT22M_PHASE_OVERSLEEP,
+						      oversleep_ns);
+	} else {
+		acq_qos_end();
+	}
+
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		if (round[i] && error[i] == 0)
+			sensor_read_finish(i, read_start[i], &results[i]);
+}
+
+/*
+ * acq_read_batch() - Read the requested sensors.
+ * @requests: The requests of the readers (completed and removed here).
+ * @periodic: The sensors whose periodic read is due.
+ *
+ * The sensors with their own gpios are read at the same time, then the
+ * multiplexed sensors one channel after the other (one frame on every
+ * data line at a time). More requests of a sensor share one read.
+ * Only called by the acquisition thread.
+ */
+static void acq_read_batch(struct list_head *requests, const bool *periodic)
+{
+	/* Static, so a build with many sensors does not grow the thread stack */
+	static struct dht22_sample results[DHT22M_MAX_DEVICES];
+	static ktime_t read_start[DHT22M_MAX_DEVICES];
+	const ktime_t batch_start = ktime_get();
+	int error[DHT22M_MAX_DEVICES];
+	int channels[DHT22M_MAX_DEVICES];
+	bool wanted[DHT22M_MAX_DEVICES] = { false };
+	bool round[DHT22M_MAX_DEVICES];
+	struct dht22_acq_request *request, *next;
+	struct dht22_config *config;
+	int srcu_idx, channel, i;
+	bool any;
+
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		read_start[i] = batch_start;
+	list_for_each_entry(request, requests, node) {
+		i = request->sensor_index;
+		wanted[i] = true;
+		read_start[i] = min(read_start[i], request->requested);
+	}
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		wanted[i] |= periodic[i];
+
+	srcu_idx = srcu_read_lock(&config_srcu);
+	config = srcu_dereference(sensor_config, &config_srcu);
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		channels[i] = config ? config->sensor_channels[i] : -1;
+	srcu_read_unlock(&config_srcu, srcu_idx);
+
+	for (channel = -1; channel < DHT22M_MUX_CHANNELS; channel++) {
+		any = false;
+		for (i = 0; i < DHT22M_MAX_DEVICES; i++) {
+			round[i] = wanted[i] && channels[i] == channel;
+			any |= round[i];
+		}
+		if (any)
+			acq_read_round(channel, round, read_start, error, results);
+	}
+
+	list_for_each_entry_safe(request, next, requests, node) {
+		i = request->sensor_index;
+		request->error = error[i];
+		if (error[i] == 0)
+			request->result = results[i];
+		list_del(&request->node);
+		complete(&request->done);
+	}
+}
+
+/* acq_pending() - The thread has something to do */
+static bool acq_pending(void)
+{
+	bool pending;
+
+	spin_lock_irq(&acq_lock);
+	pending = !list_empty(&acq_requests) || acq_period_due;
+	spin_unlock_irq(&acq_lock);
+	return pending;
+}
+
+/*
+ * acq_thread_fn() - The acquisition thread
+ *
+ * Serves the read requests of the devices and reads every sensor in
+ * every period_ms (at least the minimum time between two reads of the
+ * sensor, so every type is read at its own fastest rate) while the
+ * periodic reads are enabled.
+ */
+static int acq_thread_fn(void *data)
+{
+	struct dht22_acq_request *request, *next;
+	ktime_t next_read[DHT22M_MAX_DEVICES] = { 0 };
+	bool periodic[DHT22M_MAX_DEVICES];
+	ktime_t next_period = 0, now;
+	unsigned int period;
+	bool kick, due;
+	long timeout;
+	s64 wait_ns;
+	int i;
+	LIST_HEAD(batch);
+
+	while (!kthread_should_stop()) {
+		timeout = MAX_SCHEDULE_TIMEOUT;
+		if (READ_ONCE(period_ms) && READ_ONCE(sensor_period_enabled)) {
+			wait_ns = ktime_to_ns(ktime_sub(next_period, ktime_get()));
+			timeout = wait_ns > 0 ? nsecs_to_jiffies(wait_ns) : 0;
+		}
+		wait_event_interruptible_timeout(acq_wait, acq_pending() ||
+						 kthread_should_stop(), timeout);
+
+		spin_lock_irq(&acq_lock);
+		list_splice_init(&acq_requests, &batch);
+		kick = acq_period_due;
+		acq_period_due = false;
+		spin_unlock_irq(&acq_lock);
+
+		period = READ_ONCE(period_ms);
+		now = ktime_get();
+		due = false;
+		next_period = KTIME_MAX;
+		for (i = 0; i < DHT22M_MAX_DEVICES; i++) {
+			periodic[i] = period && READ_ONCE(sensor_period_enabled) &&
+				      i < READ_ONCE(num_gpios) &&
+				      (kick || !ktime_before(now, next_read[i]));
+			if (periodic[i]) {
+				next_read[i] = ktime_add_ms(now,
+					max(period, sensor_min_interval_ms(i)));
+				due = true;
+			}
+			if (i < READ_ONCE(num_gpios))
+				next_period = min(next_period, next_read[i]);
+		}
+		if (due || !list_empty(&batch))
+			acq_read_batch(&batch, periodic);
+	}
+
+	/* Nobody can request reads now, but do not leave a reader waiting */
+	spin_lock_irq(&acq_lock);
+	list_splice_init(&acq_requests, &batch);
+	spin_unlock_irq(&acq_lock);
+	list_for_each_entry_safe(request, next, &batch, node) {
+		request->error = -ENODEV;
+		list_del(&request->node);
+		complete(&request->done);
+	}
+	return 0;
+}
+
+/*
+ * acq_request_read() - Read a sensor by the acquisition thread.
+ * @sensor_index: Index of the sensor.
+ * @result: The result of the read.
+ *
+ * Return: 0 if the read was done (the result can still be a failure);
+ * -EBUSY, -EAGAIN, -ENODEV, -ENXIO or -EIO if the read could not be started.
+ */
+static int acq_request_read(int sensor_index, struct dht22_sample *result)
+{
+	struct dht22_acq_request request = { .sensor_index = sensor_index };
+
+	init_completion(&request.done);
+	request.requested = ktime_get();
+	spin_lock_irq(&acq_lock);
+	list_add_tail(&request.node, &acq_requests);
+	spin_unlock_irq(&acq_lock);
+	wake_up(&acq_wait);
+	wait_for_completion(&request.done);
+	if (request.error == 0)
+		*result = request.result;
+	return request.error;
+}
+
+/* sensor_period_kick() - Start the periodic reads now if they are enabled */
+static void sensor_period_kick(void)
+{
+	spin_lock_irq(&acq_lock);
+	acq_period_due = true;
+	spin_unlock_irq(&acq_lock);
+	wake_up(&acq_wait);
+}
+
+/*
+ * acq_thread_configure() - Apply acq_priority and acq_cpu to the thread.
+ * Must be called when holding the parameter lock.
+ */
+static void acq_thread_configure(void)
+{
+	struct sched_param param = {
+		.sched_priority = min_t(unsigned int, acq_priority, MAX_RT_PRIO - 1)
+	};
+	int cpu = acq_cpu;
+
+	if (!acq_thread)
+		return;
+	if (param.sched_priority)
+		sched_setscheduler_nocheck(acq_thread, SCHED_FIFO, &param);
+	else
+		sched_set_normal(acq_thread, 0);
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))) {
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": CPU %d is not online, the acquisition thread runs on any CPU\n",
+		       cpu);
+		cpu = -1;
+	}
+	set_cpus_allowed_ptr(acq_thread, cpu >= 0 ? cpumask_of(cpu) :
+						    cpu_possible_mask);
+}
+
+/* acq_thread_stop() - Stop the acquisition thread after its running batch */
+static void acq_thread_stop(void)
+{
+	struct task_struct *thread;
+
+	kernel_param_lock(THIS_MODULE);
+	thread = acq_thread;
+	acq_thread = NULL;
+	kernel_param_unlock(THIS_MODULE);
+	if (thread)
+		kthread_stop(thread);
+}
+
+/* acq_priority_set() - Setting acq_priority changes the running thread */
+static int acq_priority_set(const char *val, const struct kernel_param *kp)
+{
+	int error = param_set_uint(val, kp);
+
+	if (error == 0)
+		acq_thread_configure();
+	return error;
+}
+
+/* acq_cpu_set() - Setting acq_cpu moves the running thread */
+static int acq_cpu_set(const char *val, const struct kernel_param *kp)
+{
+	int error = param_set_int(val, kp);
+
+	if (error == 0)
+		acq_thread_configure();
+	return error;
+}
+
+/*
+ * sensor_format_result() - The text sent by the character device
+ * @result: The result of a read.
+ * @message: Destination of DHT22M_CHARDEV_BUFFSIZE bytes.
+ */
+static void sensor_format_result(const struct dht22_sample *result,
+				 char *message)
+{
+	if (result->readstate == DTH22M_READSTATE_OK) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "Ok;%s%d.%d;%d.%d\n",
+			 result->negative ? "-" : "",
+			 result->temperature / 10, result->temperature % 10,
+			 result->humidity / 10, result->humidity % 10);
+	} else if(result->readstate == DTH22M_READSTATE_CHKSUMERR) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ChecksumError\n");
+	} else if(result->readstate == DTH22M_READSTATE_TOOSOON) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ReadTooSoon\n");
+	} else if(result->readstate == DTH22M_READSTATE_COLLECT ||
+		  result->readstate == DTH22M_READSTATE_NEXT) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "NotRead\n");
+	} else {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "IOError\n");
+	}
+}
+
+/*
+ * chardevice_open() - Characted device open handler
  *
- * Configure GPIOs from the gpio_pins array
- * Check gpio value, set pin, request IRQs
- * If a configuration success, the appropriate value of sensor_states
- * set to DHT22M_STATES_CONFIGURED. Other values means errors and
- * block the read from sensor.
+ * This function starts the sensor reading process.
+ * According to the minor number we query which
+ * chardev is accessed -> which sensor needs to be read.
+ * The read is done by the acquisition thread, the opener waits for it.
+ * If the sensors are read periodically (period_ms) the result
+ * of the last read is returned instead.
+ */
+static int chardevice_open(struct inode *inode, struct file *file)
+{
+	struct dht22_cpu_cost cost = { 0 };
+	struct dht22_sample result;
+	const ktime_t format_start = ktime_get();
+	char *message;
+	int minor = iminor(inode);
+	int error = 0;
+
+	//printk(KERN_INFO DHT22M_MODULE_NAME ": Device opened (minor: %d) \n",minor);
+
+	if (READ_ONCE(period_ms)) {
+		sensor_sample_copy(minor, &result);
+	} else {
+		error = acq_request_read(minor, &result);
+	}
+
+	message = kmalloc(DHT22M_CHARDEV_BUFFSIZE, GFP_KERNEL);
+	if (!message) {
+		printk(KERN_ALERT DHT22M_MODULE_NAME
+		       ": no memory for chrdev buffer\n");
+		return -ENOMEM;
+	}
+
+	if (error == -EBUSY) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ReaderBusy\n");
+	} else if (error == -EAGAIN) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ReadTooSoon\n");
+	} else if (error == -ENODEV) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "Quarantined\n");
+	} else if (error != 0) {
+		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "IOError\n");
+	} else {
+		sensor_format_result(&result, message);
+		cost.deliver_ns = ktime_to_ns(ktime_sub(ktime_get(), format_start));
+		sensor_cpu_account(minor, &cost);
+	}
+
+	file->private_data = message;
+	return 0;
+}
+
+/* period_ms_set() - Setting period_ms (re)starts the periodic reads */
+static int period_ms_set(const char *val, const struct kernel_param *kp)
+{
+	int error = param_set_uint(val, kp);
+
+	if (error == 0)
+		sensor_period_kick();
+	return error;
+}
+
+/* chardevice_read() - Characted device read handler */
+static ssize_t chardevice_read(struct file *file, char __user *user_buf,
+			       size_t count, loff_t *ppos)
+{
+	struct dht22_cpu_cost cost = { 0 };
+	char *message = file->private_data;
+	ktime_t copy_start;
+	size_t len;
+
+	if (!message)
+		return 0;
+	len = strlen(message);
+	if (*ppos >= len)
+		return 0;
+	if (count > len - *ppos)
+		count = len - *ppos;
+	copy_start = ktime_get();
+	if (copy_to_user(user_buf, message + *ppos, count))
+		return -EFAULT;
+	cost.deliver_ns = ktime_to_ns(ktime_sub(ktime_get(), copy_start));
+	sensor_cpu_account(iminor(file_inode(file)), &cost);
+	sensor_latency_record(iminor(file_inode(file)), DHT22M_PHASE_COPYOUT,
+			      cost.deliver_ns);
+	*ppos += count;
+	return count;
+}
+
+/* chardevice_release() - Characted device release handler */
+static int chardevice_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
+
+/* The "dht22mX" character devices file operations struct */
+static struct file_operations dht22m_cdevs_fops = {
+	.owner = THIS_MODULE,
+	.read = chardevice_read,
+	.open = chardevice_open,
+	.release = chardevice_release
+};
+
+/* readstate_name() - Name of a DTH22M_READSTATE_* value as sent by the chardev */
+static const char *readstate_name(int readstate)
+{
+	switch (readstate) {
+	case DTH22M_READSTATE_OK:
+		return "Ok";
+	case DTH22M_READSTATE_CHKSUMERR:
+		return "ChecksumError";
+	case DTH22M_READSTATE_TOOSOON:
+		return "ReadTooSoon";
+	case DTH22M_READSTATE_COLLECT:
+		return "NotRead";
+	default:
+		return "IOError";
+	}
+}
+
+/*
+ * failure_ring_show() - Debugfs "failures" file: the last failed frames
+ *
+ * One line per frame, oldest first: system time, sequence number of the
+ * raw device ('-' if the frame was not streamed), failure class, edge
+ * count and the edge deltas in nanoseconds.
+ */
+static int failure_ring_show(struct seq_file *m, void *v)
+{
+	int sensor_index = (long)m->private;
+	struct dht22_failure_ring *ring = &failure_rings[sensor_index];
+	const struct dht22m_frame *frame;
+	unsigned long flags;
+	unsigned int n, first;
+	u32 nsec;
+	u64 sec;
+	int i;
+
+	spin_lock_irqsave(&failure_lock, flags);
+	first = ring->count > DHT22M_FAILURE_RING_SIZE ?
+		ring->count - DHT22M_FAILURE_RING_SIZE : 0;
+	for (n = first; n < ring->count; n++) {
+		frame = &ring->frames[n % DHT22M_FAILURE_RING_SIZE];
+		sec = div_u64_rem(frame->realtime_ns, NSEC_PER_SEC, &nsec);
+		seq_printf(m, "%llu.%09u ", sec, nsec);
+		if (ring->streamed[n % DHT22M_FAILURE_RING_SIZE])
+			seq_printf(m, "%u", frame->sequence);
+		else
+			seq_putc(m, '-');
+		seq_printf(m, " %s %d", readstate_name(frame->readstate),
+			   frame->num_edges);
+		for (i = 0; i < frame->num_edges - 1; i++)
+			seq_printf(m, " %u", frame->deltas[i]);
+		seq_putc(m, '\n');
+	}
+	spin_unlock_irqrestore(&failure_lock, flags);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(failure_ring);
+
+/*
+ * latency_show() - Debugfs "latency" file: read phase histograms
+ *
+ * For every phase a summary line (count, average and maximum in µs)
+ * followed by the nonempty log2 buckets as "from-to count" in µs.
+ */
+static int latency_show(struct seq_file *m, void *v)
+{
+	int sensor_index = (long)m->private;
+	struct dht22_latency_hist *hist;
+	unsigned long flags;
+	int phase, i;
+
+	hist = kmalloc(sizeof sensor_latency[0], GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	spin_lock_irqsave(&latency_lock, flags);
+	memcpy(hist, sensor_latency[sensor_index], sizeof sensor_latency[0]);
+	spin_unlock_irqrestore(&latency_lock, flags);
+
+	for (phase = 0; phase < DHT22M_PHASES; phase++) {
+		seq_printf(m, "%s count %llu avg_us %llu max_us %llu\n",
+			   latency_phase_names[phase], hist[phase].count,
+			   hist[phase].count ?
+			   div64_u64(hist[phase].sum_ns, hist[phase].count * NSEC_PER_USEC) : 0,
+			   div_u64(hist[phase].max_ns, NSEC_PER_USEC));
+		for (i = 0; i < DHT22M_LATENCY_BUCKETS; i++) {
+			if (!hist[phase].buckets[i])
+				continue;
+			if (i == DHT22M_LATENCY_BUCKETS - 1)
+				seq_printf(m, "  %lu- %llu\n", 1UL << (i - 1),
+					   hist[phase].buckets[i]);
+			else
+				seq_printf(m, "  %lu-%lu %llu\n",
+					   i ? 1UL << (i - 1) : 0UL, 1UL << i,
+					   hist[phase].buckets[i]);
+		}
+	}
+	kfree(hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/* cpu_cost_line() - One line of the "cpu_cost" file */
+static void cpu_cost_line(struct seq_file *m, const char *name, u64 ns,
+			  u64 samples, u64 good_samples)
+{
+	seq_printf(m, "%-9s %14llu %14llu %14llu\n", name, ns,
+		   samples ? div64_u64(ns, samples) : 0,
+		   good_samples ? div64_u64(ns, good_samples) : 0);
+}
+
+/*
+ * cpu_cost_show() - Debugfs "cpu_cost" file: CPU time spent on the sensor
+ *
+ * The number of reads and edges, then the total CPU time of every kind of
+ * work, its average per read and per successful read in nanoseconds.
+ */
+static int cpu_cost_show(struct seq_file *m, void *v)
+{
+	int sensor_index = (long)m->private;
+	struct dht22_sensor_counters *total;
+	struct dht22_counters *counters;
+	u64 samples, good, busywait, irq, decode, deliver;
+
+	counters = kmalloc(sizeof *counters, GFP_KERNEL);
+	if (!counters)
+		return -ENOMEM;
+	sensor_stats_fold(counters);
+	total = &counters->sensors[sensor_index];
+	samples = sensor_counters_samples(total);
+	good = total->results[DTH22M_READSTATE_OK];
+	busywait = total->busywait_ns;
+	irq = total->irq_ns;
+	decode = total->decode_ns;
+	deliver = total->deliver_ns;
+
+	seq_printf(m, "samples %llu good %llu\n", samples, good);
+	seq_printf(m, "edges %llu stray %llu\n", total->edges,
+		   total->stray_edges);
+	kfree(counters);
+	seq_printf(m, "%-9s %14s %14s %14s\n", "work", "total_ns",
+		   "per_sample_ns", "per_good_ns");
+	cpu_cost_line(m, "busywait", busywait, samples, good);
+	cpu_cost_line(m, "irq", irq, samples, good);
+	cpu_cost_line(m, "decode", decode, samples, good);
+	cpu_cost_line(m, "deliver", deliver, samples, good);
+	cpu_cost_line(m, "total", busywait + irq + decode + deliver,
+		      samples, good);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cpu_cost);
+
+/* lock_stats_line() - One line of the "contention" file */
+static void lock_stats_line(struct seq_file *m, const char *name,
+			    const struct dht22_lock_counters *stats)
+{
+	seq_printf(m, "%-18s %12llu %10llu %14llu %10llu\n", name,
+		   stats->acquisitions, stats->contended, stats->wait_ns,
+		   stats->contended ? div64_u64(stats->wait_ns, stats->contended) : 0);
+}
+
+/*
+ * contention_show() - Debugfs "contention" file: lock and read slot usage
+ *
+ * The contention of the locks (the sensor state locks are summed), the
+ * total time the sensors spent in every readstate (the current one is
+ * included) and the number of "ReaderBusy"/"ReadTooSoon" rejections per
+ * sensor.
+ */
+static int contention_show(struct seq_file *m, void *v)
+{
+	static const char * const readstate_names[] = {
+		"collect", "ok", "checksum_error", "other_error",
+		"too_soon", "next"
+	};
+	u64 readstate_ns[DTH22M_READSTATE_NEXT + 1] = { 0 };
+	struct dht22_counters *counters;
+	struct dht22_state *state;
+	unsigned long flags;
+	int readstate, i, j;
+
+	counters = kmalloc(sizeof *counters, GFP_KERNEL);
+	if (!counters)
+		return -ENOMEM;
+	sensor_stats_fold(counters);
+
+	seq_printf(m, "%-18s %12s %10s %14s %10s\n", "lock", "acquisitions",
+		   "contended", "wait_ns", "avg_wait_ns");
+	lock_stats_line(m, "gpio_config_mutex",
+			&counters->locks[DHT22M_LOCK_CONFIG]);
+	lock_stats_line(m, "state_lock", &counters->locks[DHT22M_LOCK_SENSOR]);
+
+	/* Not sensor_lock_irqsave(): this file must not count its own locking */
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++) {
+		state = &sensor_state[i];
+		raw_spin_lock_irqsave(&state->lock, flags);
+		for (j = 0; j <= DTH22M_READSTATE_NEXT; j++)
+			readstate_ns[j] += state->readstate_ns[j];
+		readstate = state->readstate;
+		if (readstate >= 0 && readstate <= DTH22M_READSTATE_NEXT)
+			readstate_ns[readstate] += ktime_to_ns(ktime_sub(ktime_get(),
+							state->readstate_since));
+		raw_spin_unlock_irqrestore(&state->lock, flags);
+	}
+
+	seq_printf(m, "\n%-18s %14s\n", "readstate", "time_ns");
+	for (i = 0; i <= DTH22M_READSTATE_NEXT; i++)
+		seq_printf(m, "%-18s %14llu\n", readstate_names[i],
+			   readstate_ns[i]);
+
+	seq_printf(m, "\n%-18s %12s\n", "sensor", "busy_rejects");
+	for (i = 0; i < READ_ONCE(num_gpios) && i < DHT22M_MAX_DEVICES; i++)
+		seq_printf(m, "dht22m%-12d %12llu\n", i,
+			   counters->sensors[i].busy_rejects);
+	kfree(counters);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(contention);
+
+/*
+ * struct dht22_snapshot - Consistent copy of the cached state of all sensors.
+ * Used by the summary files, so they never touch the sensors.
+ * @count: Number of configured sensors.
+ * @counters: The statistics counters summed over the CPUs.
+ */
+struct dht22_snapshot {
+	int count;
+	int gpios[DHT22M_MAX_DEVICES];
+	int irqs[DHT22M_MAX_DEVICES];
+	int states[DHT22M_MAX_DEVICES];
+	struct dht22_sample samples[DHT22M_MAX_DEVICES];
+	struct dht22_health health[DHT22M_MAX_DEVICES];
+	struct dht22_counters counters;
+};
+
+/*
+ * sensors_snapshot() - Copy the cached state of all sensors.
+ *
+ * Return: The snapshot (free with kfree) or NULL if out of memory.
+ */
+static struct dht22_snapshot *sensors_snapshot(void)
+{
+	struct dht22_config *config;
+	struct dht22_snapshot *snap;
+	unsigned long flags;
+	int srcu_idx, i;
+
+	snap = kzalloc(sizeof *snap, GFP_KERNEL);
+	if (!snap)
+		return NULL;
+	srcu_idx = srcu_read_lock(&config_srcu);
+	config = srcu_dereference(sensor_config, &config_srcu);
+	if (config) {
+		snap->count = config->num_gpios;
+		memcpy(snap->gpios, config->gpio_pins, sizeof snap->gpios);
+		memcpy(snap->irqs, config->sensor_irqs, sizeof snap->irqs);
+		memcpy(snap->states, config->sensor_states, sizeof snap->states);
+	}
+	srcu_read_unlock(&config_srcu, srcu_idx);
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		sensor_sample_copy(i, &snap->samples[i]);
+	spin_lock_irqsave(&health_lock, flags);
+	memcpy(snap->health, sensor_health, sizeof snap->health);
+	spin_unlock_irqrestore(&health_lock, flags);
+	sensor_stats_fold(&snap->counters);
+	return snap;
+}
+
+/* metric_header() - HELP and TYPE lines of a Prometheus metric */
+static void metric_header(struct seq_file *m, const char *name,
+			  const char *type, const char *help)
+{
+	seq_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* metric_tenths() - Print a value given in tenths as a decimal number */
+static void metric_tenths(struct seq_file *m, bool negative, int value)
+{
+	seq_printf(m, "%s%d.%d\n", negative ? "-" : "", value / 10, value % 10);
+}
+
+/* metric_seconds() - Print a duration given in ns as seconds */
+static void metric_seconds(struct seq_file *m, u64 ns)
+{
+	u32 nsec;
+	u64 sec = div_u64_rem(ns, NSEC_PER_SEC, &nsec);
+
+	seq_printf(m, "%llu.%09u\n", sec, nsec);
+}
+
+/*
+ * metrics_show() - Proc "dht22m_metrics" file: Prometheus text format
+ *
+ * Renders the cached samples, health and counters of every configured
+ * sensor and the lock statistics. Never starts a sensor read.
+ */
+static int metrics_show(struct seq_file *m, void *v)
+{
+	static const char * const health_names[] = { "ok", "backoff", "quarantined" };
+	const ktime_t now = ktime_get();
+	struct dht22_snapshot *snap;
+	const int *gpios, *states;
+	struct dht22_sample *samples;
+	struct dht22_health *health;
+	struct dht22_sensor_counters *counters;
+	struct dht22_lock_counters *locks;
+	int count, i, j;
+
+	snap = sensors_snapshot();
+	if (!snap)
+		return -ENOMEM;
+	count = snap->count;
+	gpios = snap->gpios;
+	states = snap->states;
+	samples = snap->samples;
+	health = snap->health;
+	counters = snap->counters.sensors;
+	locks = snap->counters.locks;
+
+#define SENSOR_LABELS "{sensor=\"dht22m%d\",gpio=\"%d\"} "
+	metric_header(m, "dht22m_temperature_celsius", "gauge",
+		      "Last successfully read temperature.");
+	for (i = 0; i < count; i++) {
+		if (!samples[i].valid)
+			continue;
+		seq_printf(m, "dht22m_temperature_celsius" SENSOR_LABELS, i, gpios[i]);
+		metric_tenths(m, samples[i].negative, samples[i].temperature);
+	}
+	metric_header(m, "dht22m_humidity_percent", "gauge",
+		      "Last successfully read relative humidity.");
+	for (i = 0; i < count; i++) {
+		if (!samples[i].valid)
+			continue;
+		seq_printf(m, "dht22m_humidity_percent" SENSOR_LABELS, i, gpios[i]);
+		metric_tenths(m, false, samples[i].humidity);
+	}
+	metric_header(m, "dht22m_sample_age_seconds", "gauge",
+		      "Time since the last successful read.");
+	for (i = 0; i < count; i++) {
+		if (!samples[i].valid)
+			continue;
+		seq_printf(m, "dht22m_sample_age_seconds" SENSOR_LABELS, i, gpios[i]);
+		metric_seconds(m, ktime_to_ns(ktime_sub(now, samples[i].sample_time)));
+	}
+	metric_header(m, "dht22m_last_read_ok", "gauge",
+		      "1 if the last read succeeded, 0 if failed or no read yet.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_last_read_ok" SENSOR_LABELS "%d\n", i, gpios[i],
+			   samples[i].readstate == DTH22M_READSTATE_OK);
+	metric_header(m, "dht22m_configured", "gauge",
+		      "1 if the gpio and the IRQ of the sensor are configured.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_configured" SENSOR_LABELS "%d\n", i, gpios[i],
+			   states[i] == DHT22M_STATES_CONFIGURED);
+	metric_header(m, "dht22m_health", "gauge",
+		      "Health state of the sensor (1 for the current state).");
+	for (i = 0; i < count; i++) {
+		int state;
+
+		for (state = 0; state < ARRAY_SIZE(health_names); state++)
+			seq_printf(m, "dht22m_health{sensor=\"dht22m%d\",gpio=\"%d\","
+				   "state=\"%s\"} %d\n", i, gpios[i],
+				   health_names[state], health[i].state == state);
+	}
+	metric_header(m, "dht22m_reads_total", "counter", "Finished reads.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_reads_total" SENSOR_LABELS "%llu\n", i,
+			   gpios[i], health[i].reads);
+	metric_header(m, "dht22m_failures_total", "counter", "Failed reads.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_failures_total" SENSOR_LABELS "%llu\n", i,
+			   gpios[i], health[i].failures);
+	metric_header(m, "dht22m_quarantines_total", "counter",
+		      "Times the sensor was put into quarantine.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_quarantines_total" SENSOR_LABELS "%u\n", i,
+			   gpios[i], health[i].quarantines);
+	metric_header(m, "dht22m_power_cycles_total", "counter",
+		      "Times the sensor was power cycled.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_power_cycles_total" SENSOR_LABELS "%u\n", i,
+			   gpios[i], health[i].power_cycles);
+	metric_header(m, "dht22m_busy_rejects_total", "counter",
+		      "Reads rejected as busy or too soon.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_busy_rejects_total" SENSOR_LABELS "%llu\n", i,
+			   gpios[i], counters[i].busy_rejects);
+	metric_header(m, "dht22m_read_results_total", "counter",
+		      "Finished reads by result.");
+	for (i = 0; i < count; i++) {
+		static const char * const result_names[] = {
+			[DTH22M_READSTATE_OK] = "ok",
+			[DTH22M_READSTATE_CHKSUMERR] = "checksum_error",
+			[DTH22M_READSTATE_OTHERR] = "other_error"
+		};
+
+		for (j = DTH22M_READSTATE_OK; j <= DTH22M_READSTATE_OTHERR; j++)
+			seq_printf(m, "dht22m_read_results_total{sensor=\"dht22m%d\","
+				   "gpio=\"%d\",result=\"%s\"} %llu\n", i, gpios[i],
+				   result_names[j], counters[i].results[j]);
+	}
+	metric_header(m, "dht22m_edges_total", "counter",
+		      "Edges recorded during the reads.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_edges_total" SENSOR_LABELS "%llu\n", i,
+			   gpios[i], counters[i].edges);
+	metric_header(m, "dht22m_stray_edges_total", "counter",
+		      "Edges out of the reads or after a complete frame.");
+	for (i = 0; i < count; i++)
+		seq_printf(m, "dht22m_stray_edges_total" SENSOR_LABELS "%llu\n", i,
+			   gpios[i], counters[i].stray_edges);
+	metric_header(m, "dht22m_cpu_irq_seconds_total", "counter",
+		      "Time spent in the edge interrupt handler.");
+	for (i = 0; i < count; i++) {
+		seq_printf(m, "dht22m_cpu_irq_seconds_total" SENSOR_LABELS, i, gpios[i]);
+		metric_seconds(m, counters[i].irq_ns);
+	}
+#undef SENSOR_LABELS
+
+	metric_header(m, "dht22m_lock_acquisitions_total", "counter",
+		      "Acquisitions of the locks (state_lock: all sensor state locks).");
+	seq_printf(m, "dht22m_lock_acquisitions_total{lock=\"gpio_config_mutex\"} %llu\n",
+		   locks[DHT22M_LOCK_CONFIG].acquisitions);
+	seq_printf(m, "dht22m_lock_acquisitions_total{lock=\"state_lock\"} %llu\n",
+		   locks[DHT22M_LOCK_SENSOR].acquisitions);
+	metric_header(m, "dht22m_lock_contended_total", "counter",
+		      "Acquisitions of the locks which had to wait.");
+	seq_printf(m, "dht22m_lock_contended_total{lock=\"gpio_config_mutex\"} %llu\n",
+		   locks[DHT22M_LOCK_CONFIG].contended);
+	seq_printf(m, "dht22m_lock_contended_total{lock=\"state_lock\"} %llu\n",
+		   locks[DHT22M_LOCK_SENSOR].contended);
+	metric_header(m, "dht22m_lock_wait_seconds_total", "counter",
+		      "Time spent waiting for the locks.");
+	seq_puts(m, "dht22m_lock_wait_seconds_total{lock=\"gpio_config_mutex\"} ");
+	metric_seconds(m, locks[DHT22M_LOCK_CONFIG].wait_ns);
+	seq_puts(m, "dht22m_lock_wait_seconds_total{lock=\"state_lock\"} ");
+	metric_seconds(m, locks[DHT22M_LOCK_SENSOR].wait_ns);
+	kfree(snap);
+	return 0;
+}
+
+/*
+ * summary_show() - Proc "dht22m" file: one line summary of every sensor
+ *
+ * Gpio, IRQ, configuration state, last sample and its age, result of the
+ * last read, error rates, health and the time until the next read is
+ * allowed (or scheduled with period_ms). Built from the cached state
+ * only, never starts a sensor read.
+ */
+static int summary_show(struct seq_file *m, void *v)
+{
+	static const char * const state_names[] = {
+		"zeroconf", "configured", "gpioerror", "irqerror"
+	};
+	static const char * const health_names[] = { "ok", "backoff", "quarantined" };
+	const unsigned int period = READ_ONCE(period_ms);
+	const ktime_t now = ktime_get();
+	struct dht22_snapshot *snap;
+	const struct dht22_sample *sample;
+	const struct dht22_health *health;
+	char temperature[12], humidity[12];
+	unsigned int permille;
+	ktime_t next;
+	s64 next_ms;
+	int i;
+
+	snap = sensors_snapshot();
+	if (!snap)
+		return -ENOMEM;
+	seq_printf(m, "%-8s %5s %5s %-10s %7s %6s %9s %-13s %7s %13s %-11s %8s\n",
+		   "sensor", "gpio", "irq", "state", "temp", "hum", "age_ms",
+		   "last", "error_%", "failed/reads", "health", "next_ms");
+	for (i = 0; i < snap->count; i++) {
+		sample = &snap->samples[i];
+		health = &snap->health[i];
+		seq_printf(m, "dht22m%-2d %5d %5d %-10s ", i, snap->gpios[i],
+			   snap->irqs[i], snap->states[i] < ARRAY_SIZE(state_names) ?
+			   state_names[snap->states[i]] : "unknown");
+		if (sample->valid) {
+			/* Formatted first, so the sign stays in the column */
+			snprintf(temperature, sizeof temperature, "%s%d.%d",
+				 sample->negative ? "-" : "",
+				 sample->temperature / 10, sample->temperature % 10);
+			snprintf(humidity, sizeof humidity, "%d.%d",
+				 sample->humidity / 10, sample->humidity % 10);
+			seq_printf(m, "%7s %6s %9lld ", temperature, humidity,
+				   ktime_to_ms(ktime_sub(now, sample->sample_time)));
+		} else {
+			seq_printf(m, "%7s %6s %9s ", "-", "-", "-");
+		}
+
+		/*
+		 * The earliest time of the next read: health backoff, read
+		 * interval or the next periodic read.
+		 */
+		next = health->next_allowed;
+		if (sample->valid)
+			next = max(next, ktime_add_ms(sample->sample_time,
+						      sensor_min_interval_ms(i)));
+		if (period && sample->readstate != DTH22M_READSTATE_NEXT)
+			next = max(next, ktime_add_ms(sample->read_time,
+					max(period, sensor_min_interval_ms(i))));
+		next_ms = max_t(s64, ktime_to_ms(ktime_sub(next, now)), 0);
+
+		permille = ((u64)health->error_ewma * 1000) >> DHT22M_EWMA_SCALE_SHIFT;
+		seq_printf(m, "%-13s %5u.%u %6llu/%-6llu %-11s %8lld\n",
+			   sample->readstate == DTH22M_READSTATE_NEXT ? "-" :
+			   readstate_name(sample->readstate),
+			   permille / 10, permille % 10,
+			   health->failures, health->reads,
+			   health_names[health->state], next_ms);
+	}
+	kfree(snap);
+	return 0;
+}
+
+/* Maximum number of frames accepted by the debugfs replay file */
+#define DHT22M_REPLAY_MAX_FRAMES	4096
+/* Every replayed frame is decoded this many times to measure the decoder */
+#define DHT22M_REPLAY_REPEAT		16
+
+/*
+ * struct dht22_replay_result - Result of a frame replayed through the decoder.
+ * @sequence: Sequence number of the recorded frame.
+ * @recorded: The readstate recorded in the frame.
+ * @replayed: The readstate given by the decoder now.
+ * @temperature: Decoded temperature (times ten, signed).
+ * @humidity: Decoded humidity (times ten).
+ * @decode_ns: Average run time of sensor_parse_bytes() on the frame.
+ */
+struct dht22_replay_result {
+	u32 sequence;
+	u8 recorded;
+	u8 replayed;
+	s16 temperature;
+	u16 humidity;
+	u32 decode_ns;
+};
+
+/*
+ * struct dht22_replay - State of the debugfs replay file.
+ * @partial: Frame under assembly when a write ends in the middle of a frame.
+ * @partial_len: Number of bytes in partial.
+ * @decoder: Sensor state used to decode the replayed frames.
+ * @count: Number of replayed frames.
+ * @results: The replay results (allocated on first use).
+ */
+struct dht22_replay {
+	struct dht22m_frame partial;
+	size_t partial_len;
+	struct dht22_state decoder;
+	unsigned int count;
+	struct dht22_replay_result *results;
+};
+
+/*
+ * replay_state may only be accessed when holding replay_mutex.
+ */
+static struct dht22_replay replay_state;
+static DEFINE_MUTEX(replay_mutex);
+
+/*
+ * sensor_replay_frame() - Run a recorded frame through the decoder.
+ * @frame: The recorded frame.
+ *
+ * Rebuilds the edge timings from the deltas of the frame and decodes
+ * them with exactly the same sensor_parse_bytes() as a live read does.
+ * Must be called when holding replay_mutex.
+ *
+ * Return: 0 on success; -EINVAL on bad frame, -ENOSPC or -ENOMEM.
  */
-static int configure_gpios(void)
+static int sensor_replay_frame(const struct dht22m_frame *frame)
 {
+	struct dht22_state *state = &replay_state.decoder;
+	struct dht22_replay_result *result;
+	u64 start, elapsed;
 	int i;
 
-	printk(KERN_INFO DHT22M_MODULE_NAME ": configure sensors gpios\n");
-	for (i = 0; i < num_gpios; ++i) {
-		if (!gpio_is_valid(gpio_pins[i])) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME ": invalid GPIO pin\n");
-			sensor_states[i] = DHT22M_STATES_GPIOERROR;
-			continue;
-		}
+	if (frame->magic != DHT22M_FRAME_MAGIC ||
+	    frame->num_edges > DHT22M_FRAME_EDGES ||
+	    frame->type >= DHT22M_TYPES)
+		return -EINVAL;
+	if (replay_state.count >= DHT22M_REPLAY_MAX_FRAMES)
+		return -ENOSPC;
+	if (!replay_state.results) {
+		replay_state.results = vzalloc(DHT22M_REPLAY_MAX_FRAMES *
+					       sizeof *replay_state.results);
+		if (!replay_state.results)
+			return -ENOMEM;
+	}
 
-		if (gpio_request(gpio_pins[i], DHT22M_MODULE_NAME) < 0) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME ": gpio_request failed\n");
-			sensor_states[i] = DHT22M_STATES_GPIOERROR;
-			continue;
-		}
+	memset(state, 0, sizeof *state);
+	state->index = -1;
+	state->gpio = frame->gpio;
+	state->type = frame->type;
+	state->num_edges = frame->num_edges;
+	if (frame->num_edges > 1) {
+		memcpy(state->deltas, frame->deltas,
+		       (frame->num_edges - 1) * sizeof state->deltas[0]);
+		for (i = 0; i < frame->num_edges - 1; i++)
+			state->last_edge += frame->deltas[i];
+	}
 
-		if (gpio_direction_input(gpio_pins[i])) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME
-				": initial gpio_direction_input failed\n");
-			gpio_free(gpio_pins[i]);
-			sensor_states[i] = DHT22M_STATES_GPIOERROR;
-			continue;
-		}
+	start = ktime_get_ns();
+	for (i = 0; i < DHT22M_REPLAY_REPEAT; i++)
+		sensor_parse_bytes(state);
+	elapsed = ktime_get_ns() - start;
 
-		if ((sensor_irqs[i] = gpio_to_irq(gpio_pins[i])) < 0) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME ": gpio_to_irq failed\n");
-			gpio_free(gpio_pins[i]);
-			sensor_states[i] = DHT22M_STATES_IRQERROR;
-			continue;
-		}
+	result = &replay_state.results[replay_state.count++];
+	result->sequence = frame->sequence;
+	result->recorded = frame->readstate;
+	result->replayed = state->readstate;
+	result->temperature = state->negative ? -state->temperature :
+						state->temperature;
+	result->humidity = state->humidity;
+	result->decode_ns = div_u64(elapsed, DHT22M_REPLAY_REPEAT);
+	return 0;
+}
 
-		if (request_irq(sensor_irqs[i], s_handle_edge,
-				IRQF_TRIGGER_FALLING,DHT22M_MODULE_NAME,
-				&gpio_pins[i]) < 0) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME ": request_irq failed\n");
-			gpio_free(gpio_pins[i]);
-			sensor_states[i] = DHT22M_STATES_IRQERROR;
-			continue;
-		}
+/*
+ * replay_show() - Debugfs "replay" file read: results of the replayed frames
+ *
+ * One line per frame: sequence, recorded result, replayed result,
+ * temperature, humidity and decode time in nanoseconds.
+ * Closed by a summary line starting with '#'.
+ */
+static int replay_show(struct seq_file *m, void *v)
+{
+	const struct dht22_replay_result *result;
+	unsigned int i, ok = 0, chksum = 0, changed = 0;
+	u64 decode_ns = 0;
 
-		sensor_states[i] = DHT22M_STATES_CONFIGURED;
-		printk(KERN_INFO DHT22M_MODULE_NAME ": GPIO %d configured (IRQ %d)\n",
-		       gpio_pins[i], sensor_irqs[i]);
+	mutex_lock(&replay_mutex);
+	for (i = 0; i < replay_state.count; i++) {
+		result = &replay_state.results[i];
+		seq_printf(m, "%u %s %s %d %u %u\n", result->sequence,
+			   readstate_name(result->recorded),
+			   readstate_name(result->replayed),
+			   result->temperature, result->humidity,
+			   result->decode_ns);
+		if (result->replayed == DTH22M_READSTATE_OK)
+			ok++;
+		else if (result->replayed == DTH22M_READSTATE_CHKSUMERR)
+			chksum++;
+		if (result->replayed != result->recorded)
+			changed++;
+		decode_ns += result->decode_ns;
 	}
+	seq_printf(m, "# frames %u ok %u checksum_error %u other_error %u "
+		   "changed %u avg_decode_ns %llu\n",
+		   replay_state.count, ok, chksum,
+		   replay_state.count - ok - chksum, changed,
+		   replay_state.count ? div_u64(decode_ns, replay_state.count) : 0);
+	mutex_unlock(&replay_mutex);
 	return 0;
 }
 
 /*
- * free_gpios() - Free all configured GPIOs and IRQs
+ * replay_open() - Debugfs "replay" file open
+ *
+ * Opening for write with truncation (shell ">" redirection) drops
+ * the results of the previous replay.
  */
-static void free_gpios(void)
+static int replay_open(struct inode *inode, struct file *file)
 {
-	int i;
-
-	printk(KERN_INFO DHT22M_MODULE_NAME ": Free IRQ and GPIOs\n");
-	for (i = 0; i < DHT22M_MAX_DEVICES; ++i) {
-		if (sensor_states[i] == DHT22M_STATES_CONFIGURED) {
-			/*
-			printk(KERN_INFO DHT22M_MODULE_NAME
-			       ": Free IRQ %d and GPIO %d\n",sensor_irqs[i],gpio_pins[i]);
-			*/
-			free_irq(sensor_irqs[i], &gpio_pins[i]);
-			gpio_free(gpio_pins[i]);
-			sensor_states[i] = DHT22M_STATES_ZEROCONF;
-		}
+	if ((file->f_mode & FMODE_WRITE) && (file->f_flags & O_TRUNC)) {
+		mutex_lock(&replay_mutex);
+		replay_state.count = 0;
+		replay_state.partial_len = 0;
+		mutex_unlock(&replay_mutex);
 	}
+	return single_open(file, replay_show, NULL);
 }
 
 /*
- * dht22m_gpios_store() - Sysfs write handler, gpio config function
+ * replay_write() - Debugfs "replay" file write: recorded frames to decode
  *
- * Receices a string from the userspace through sysfs which contains the gpio numbers.
+ * Accepts a stream of struct dht22m_frame records as read from the
+ * dht22mX-raw devices. The records may be split between writes.
  */
-static ssize_t dht22m_gpios_store(struct class *class,
-				  struct class_attribute *attr,
-				  const char *buf, size_t count)
+static ssize_t replay_write(struct file *file, const char __user *user_buf,
+			    size_t count, loff_t *ppos)
 {
-	int full_length;
-	char localbuf[32];
-	char *runner;
-	int i,gpiovalue;
-	char is_change;
-
-	int new_gpio_pins[DHT22M_MAX_DEVICES] = {0};
-	int new_num_gpios = 0;
+	const size_t frame_size = sizeof replay_state.partial;
+	size_t done = 0, chunk;
+	int error = 0;
 
-	strscpy(localbuf, buf, sizeof(localbuf));
-	full_length = strlen(localbuf);
-	runner = localbuf;
-	for(i = 0; i < full_length && new_num_gpios < DHT22M_MAX_DEVICES; ++i) {
-		if (localbuf[i] == ' ' || localbuf[i] == ';' || localbuf[i] == ',') {
-			localbuf[i] = '\0';
-			if(sscanf(runner, "%d", &gpiovalue) == 1) {
-				new_gpio_pins[new_num_gpios] = gpiovalue;
-				++new_num_gpios;
-				/* If we have more characters until the string end */
-				if (i + 1 < full_length) {
-					/* runner will points the next char
-					 * after the converted separator
-					 */
-					runner = localbuf + i + 1;
-					continue;
-				} else {
-					break; /* It was the last number */
-				}
-			} else {
-				break; /* Some bad data found */
-			}
-		}
-		if (i + 1 == full_length) {
-			if(sscanf(runner, "%d", &gpiovalue) == 1) {
-				new_gpio_pins[new_num_gpios] = gpiovalue;
-				++new_num_gpios;
-				break; /* It was the last number */
-			}
+	mutex_lock(&replay_mutex);
+	while (done < count) {
+		chunk = min(count - done, frame_size - replay_state.partial_len);
+		if (copy_from_user((u8 *)&replay_state.partial +
+				   replay_state.partial_len,
+				   user_buf + done, chunk)) {
+			error = -EFAULT;
+			break;
 		}
+		done += chunk;
+		replay_state.partial_len += chunk;
+		if (replay_state.partial_len < frame_size)
+			break;
+		replay_state.partial_len = 0;
+		error = sensor_replay_frame(&replay_state.partial);
+		if (error)
+			break;
 	}
+	mutex_unlock(&replay_mutex);
+	return error ? error : done;
+}
 
-	/* Only for debugging
-	for (i = 0; i < new_num_gpios; ++i)
-		printk(KERN_INFO DHT22M_MODULE_NAME
-		       ": About to set gpio %d to on pos %d\n",new_gpio_pins[i],i);
-	*/
-
-	mutex_lock(&gpio_config_mutex);
-	is_change = 0;
-	for(i = 0; i < DHT22M_MAX_DEVICES; ++i)
-		if (gpio_pins[i] != new_gpio_pins[i]) {
-			is_change = 1;
-			break;
-		}
-	if(is_change) {
-		free_gpios();
-		remove_devices();
+/* The debugfs "replay" file operations struct */
+static const struct file_operations replay_fops = {
+	.owner = THIS_MODULE,
+	.open = replay_open,
+	.read = seq_read,
+	.write = replay_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
 
-		num_gpios = new_num_gpios;
-		for(i = 0; i < DHT22M_MAX_DEVICES; ++i)
-			gpio_pins[i] = new_gpio_pins[i];
+#ifdef DHT22M_BENCH
+/* Number of edges handled by one measurement of the edge benchmark */
+#define DHT22M_BENCH_EDGES	100000
 
-		configure_gpios();
-		create_devices();
-		printk(KERN_INFO DHT22M_MODULE_NAME ": Conf req - %d GPIOs set. \n", num_gpios);
-	} else {
-		printk(KERN_INFO DHT22M_MODULE_NAME ": Conf req - GPIOs unchanged. \n");
-	}
-	mutex_unlock(&gpio_config_mutex);
-	return count;
-}
+/* The edges of the benchmark go to this state, not to a real sensor */
+static struct dht22_state bench_state;
+/* The selected channel of a fake multiplexer line: the benchmark state */
+static struct dht22_state *bench_mux_active = &bench_state;
 
 /*
- * dht22m_gpios_show() -  Sysfs read handler: print the current configured gpios
+ * bench_edge_path() - Measure the cost of an edge handler.
+ * @m: Output of the results.
+ * @name: Name of the measured path.
+ * @handler: The edge handler.
+ * @dev_id: The dev_id of the handler, the benchmark state or its mux line.
+ * @collect: Run the handler during a read (true) or out of reads (false).
+ *
+ * Calls the handler in a tight loop with disabled interrupts (like in
+ * hardirq context) on a fake sensor read, which is restarted after every
+ * complete frame. Runs on its own state, so the sensors are not blocked.
+ * Must be called when holding bench_mutex.
  */
-static ssize_t dht22m_gpios_show(struct class *class,
-				 struct class_attribute *attr, char *buf)
+static void bench_edge_path(struct seq_file *m, const char *name,
+			    irq_handler_t handler, void *dev_id, bool collect)
 {
-	int i;
-	int len = 0;
+	unsigned long flags, irqflags;
+	u64 elapsed = 0, start;
+	int done, i;
 
-	mutex_lock(&gpio_config_mutex);
-	for (i = 0; i < num_gpios; ++i) {
-		if (i > 0) {
-			len += sprintf(buf + len, " ");
-		}
-		len += sprintf(buf + len, "%d", gpio_pins[i]);
+	for (done = 0; done < DHT22M_BENCH_EDGES; done += DHT22M_FRAME_EDGES - 1) {
+		sensor_lock_irqsave(&bench_state, flags);
+		bench_state.gpio = -1;
+		bench_state.readstate = collect ? DTH22M_READSTATE_COLLECT :
+						  DTH22M_READSTATE_NEXT;
+		bench_state.start = ktime_sub_us(ktime_get(), 1000);
+		bench_state.last_edge = bench_state.start;
+		bench_state.num_edges = 1;
+		raw_spin_unlock_irqrestore(&bench_state.lock, flags);
+
+		local_irq_save(irqflags);
+		start = ktime_get_ns();
+		for (i = 0; i < DHT22M_FRAME_EDGES - 1; i++)
+			handler(0, dev_id);
+		elapsed += ktime_get_ns() - start;
+		local_irq_restore(irqflags);
+		cond_resched();
 	}
-	mutex_unlock(&gpio_config_mutex);
-	len += sprintf(buf + len, "\n");
-	return len;
+	seq_printf(m, "%-16s %8d %8llu\n", name, done, div_u64(elapsed, done));
 }
 
-/* Sysfs attribute for gpio set file "gpiolist" */
-static struct class_attribute dht22m_class_attr =
-	__ATTR(gpiolist, 0664, dht22m_gpios_show, dht22m_gpios_store);
+/* bench_ktime_handler() - Only takes the timestamp: the floor of every path */
+static irqreturn_t bench_ktime_handler(int irq, void *dev_id)
+{
+	ktime_t now = ktime_get();
+
+	barrier();
+	(void)now;
+	return IRQ_HANDLED;
+}
 
 /*
- * chardevice_open() - Characted device open handler
+ * bench_edge_show() - Debugfs "bench_edge" file: edge handler benchmark
  *
- * This function starts the sensor reading process.
- * According to the minor number we query which
- * chardev is accessed -> which sensor needs to be read.
+ * Prints the cost of the edge capture paths in nanoseconds per call.
+ * The handlers are called directly, not through the IRQ path, so the
+ * numbers do not depend on edge_irq_no_thread.
+ * The sensors can be read during the benchmark.
  */
-static int chardevice_open(struct inode *inode, struct file *file)
+static int bench_edge_show(struct seq_file *m, void *v)
 {
-	int readstate, hum_int, hum_frac, temp_int, temp_frac;
-	unsigned long flags;
-	char sign[2];
-	char *message;
-	int minor = iminor(inode);
-	int error;
+	static DEFINE_MUTEX(bench_mutex);
 
-	//printk(KERN_INFO DHT22M_MODULE_NAME ": Device opened (minor: %d) \n",minor);
+	mutex_lock(&bench_mutex);
 
-	error = sensor_start_read(minor);
-	if (error != 0) {
-		spin_lock_irqsave(&sensor_lock, flags);
-		sensor_state.readstate = DTH22M_READSTATE_NEXT;
-		spin_unlock_irqrestore(&sensor_lock, flags);
+	seq_printf(m, "%-16s %8s %8s\n", "path", "calls", "ns/call");
+	bench_edge_path(m, "ktime_get", bench_ktime_handler, &bench_state, true);
+	bench_edge_path(m, "s_handle_edge", s_handle_edge, &bench_state, true);
+	bench_edge_path(m, "s_handle_mux_edge", s_handle_mux_edge,
+			&bench_mux_active, true);
+	bench_edge_path(m, "s_handle_edge_idle", s_handle_edge, &bench_state,
+			false);
+	mutex_unlock(&bench_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_edge);
+#endif /* DHT22M_BENCH */
 
-		message = kmalloc(DHT22M_CHARDEV_BUFFSIZE, GFP_KERNEL);
-		if (!message) {
-			printk(KERN_ALERT DHT22M_MODULE_NAME
-			       ": no memory for chrdev buffer\n");
-			return -ENOMEM;
-		}
+/* raw_frame_ready() - True if the frame with sequence number pos is captured */
+static bool raw_frame_ready(struct dht22_raw_ring *ring, u32 pos)
+{
+	return READ_ONCE(ring->count) != pos;
+}
 
-		if (error == -EBUSY) {
-			snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ReaderBusy\n");
-		} else {
-			snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "IOError\n");
-		}
+/*
+ * raw_chardevice_open() - Raw characted device open handler
+ *
+ * The reader receives the frames captured after the open.
+ * The minor numbers of the raw devices follow the normal devices.
+ */
+static int raw_chardevice_open(struct inode *inode, struct file *file)
+{
+	int sensor_index = iminor(inode) - DHT22M_MAX_DEVICES;
+	struct dht22_raw_ring *ring = &raw_rings[sensor_index];
+	unsigned long flags;
 
-		file->private_data = message;
-		return 0;
-	}
+	file->private_data = (void *)(long)sensor_index;
+	spin_lock_irqsave(&raw_lock, flags);
+	file->f_pos = ring->count;
+	spin_unlock_irqrestore(&raw_lock, flags);
+	atomic_inc(&ring->readers);
+	return nonseekable_open(inode, file);
+}
 
-	msleep(20);  /* Read cycle takes less than 6ms. */
-	sensor_parse_bytes();
-	sign[0] = '\0';
-	sign[1] = '\0';
-
-	/* Read sensor data (protected by sensor_lock) into local variables. */
-	spin_lock_irqsave(&sensor_lock, flags);
-	readstate = sensor_state.readstate;
-	hum_int = sensor_state.humidity / 10;
-	hum_frac = sensor_state.humidity % 10;
-	temp_int = sensor_state.temperature / 10;
-	temp_frac = sensor_state.temperature % 10;
-	if (sensor_state.negative)
-		sign[0] = '-';
-	sensor_state.readstate = DTH22M_READSTATE_NEXT;
-	spin_unlock_irqrestore(&sensor_lock, flags);
-	/* Sensor lock released. */
+/*
+ * raw_chardevice_read() - Raw characted device read handler
+ *
+ * Copies whole struct dht22m_frame records. The file position holds the
+ * sequence number of the next frame; a reader which falls behind more than
+ * DHT22M_RAW_RING_SIZE frames continues with the oldest buffered frame.
+ * Blocks until a frame is available unless O_NONBLOCK is set.
+ */
+static ssize_t raw_chardevice_read(struct file *file, char __user *user_buf,
+				   size_t count, loff_t *ppos)
+{
+	struct dht22_raw_ring *ring = &raw_rings[(long)file->private_data];
+	struct dht22m_frame frame;
+	unsigned long flags;
+	size_t copied = 0;
+	u32 pos = *ppos;
+	int error;
 
-	message = kmalloc(DHT22M_CHARDEV_BUFFSIZE, GFP_KERNEL);
-	if (!message) {
-		printk(KERN_ALERT DHT22M_MODULE_NAME
-		       ": no memory for chrdev buffer\n");
-		return -ENOMEM;
+	if (count < sizeof frame)
+		return -EINVAL;
+	if (!raw_frame_ready(ring, pos)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		error = wait_event_interruptible(ring->wait,
+						 raw_frame_ready(ring, pos));
+		if (error)
+			return error;
 	}
+	while (copied + sizeof frame <= count) {
+		spin_lock_irqsave(&raw_lock, flags);
+		if (ring->count == pos) {
+			spin_unlock_irqrestore(&raw_lock, flags);
+			break;
+		}
+		if (ring->count - pos > DHT22M_RAW_RING_SIZE)
+			pos = ring->count - DHT22M_RAW_RING_SIZE;
+		frame = ring->frames[pos % DHT22M_RAW_RING_SIZE];
+		spin_unlock_irqrestore(&raw_lock, flags);
 
-	if (readstate == DTH22M_READSTATE_OK) {
-		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "Ok;%s%d.%d;%d.%d\n",
-			 sign,temp_int, temp_frac,hum_int, hum_frac);
-	} else if(readstate == DTH22M_READSTATE_CHKSUMERR) {
-		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ChecksumError\n");
-	} else if(readstate == DTH22M_READSTATE_TOOSOON) {
-		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "ReadTooSoon\n");
-	} else if(readstate == DTH22M_READSTATE_COLLECT) {
-		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "NotRead\n");
-	} else {
-		snprintf(message,DHT22M_CHARDEV_BUFFSIZE, "IOError\n");
+		if (copy_to_user(user_buf + copied, &frame, sizeof frame))
+			return copied ? copied : -EFAULT;
+		copied += sizeof frame;
+		pos++;
+		*ppos = pos;
 	}
-
-	file->private_data = message;
-	return 0;
+	return copied;
 }
 
-/* chardevice_read() - Characted device read handler */
-static ssize_t chardevice_read(struct file *file, char __user *user_buf,
-			       size_t count, loff_t *ppos)
+/* raw_chardevice_poll() - Raw characted device poll handler */
+static __poll_t raw_chardevice_poll(struct file *file, poll_table *wait)
 {
-	char *message = file->private_data;
-	size_t len;
+	struct dht22_raw_ring *ring = &raw_rings[(long)file->private_data];
 
-	if (!message)
-		return 0;
-	len = strlen(message);
-	if (*ppos >= len)
-		return 0;
-	if (count > len - *ppos)
-		count = len - *ppos;
-	if (copy_to_user(user_buf, message + *ppos, count))
-		return -EFAULT;
-	*ppos += count;
-	return count;
+	poll_wait(file, &ring->wait, wait);
+	if (raw_frame_ready(ring, file->f_pos))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
 }
 
-/* chardevice_release() - Characted device release handler */
-static int chardevice_release(struct inode *inode, struct file *file)
+/* raw_chardevice_release() - Raw characted device release handler */
+static int raw_chardevice_release(struct inode *inode, struct file *file)
 {
-	kfree(file->private_data);
-	file->private_data = NULL;
+	atomic_dec(&raw_rings[(long)file->private_data].readers);
 	return 0;
 }
 
-/* The "dht22mX" character devices file operations struct */
-static struct file_operations dht22m_cdevs_fops = {
+/* The "dht22mX-raw" character devices file operations struct */
+static struct file_operations dht22m_raw_cdevs_fops = {
 	.owner = THIS_MODULE,
-	.read = chardevice_read,
-	.open = chardevice_open,
-	.release = chardevice_release
+	.read = raw_chardevice_read,
+	.poll = raw_chardevice_poll,
+	.open = raw_chardevice_open,
+	.release = raw_chardevice_release,
+	.llseek = no_llseek
 };
 
 /*
@@ -637,8 +4100,10 @@ static int create_devices(void)
 {
 	int i;
 
-	for (i = 0; i < DHT22M_MAX_DEVICES; ++i)
+	for (i = 0; i < DHT22M_MAX_DEVICES; ++i) {
 		chardev_created[i] = 0;
+		raw_chardev_created[i] = 0;
+	}
 
 	for (i = 0; i < num_gpios && i < DHT22M_MAX_DEVICES; ++i) {
 		cdev_init(&dht22m_cdevs[i], &dht22m_cdevs_fops);
@@ -649,11 +4114,36 @@ static int create_devices(void)
 			chardev_created[i] = 0;
 			continue;
 		} else {
-			device_create(dht22m_class, NULL,
+			device_create_with_groups(dht22m_class, NULL,
 				      MKDEV(MAJOR(dht22m_dev), MINOR(dht22m_dev) + i),
-				       NULL, "dht22m%d", i);
+				      (void *)(long)i, dht22m_sensor_groups,
+				      "dht22m%d", i);
 			chardev_created[i] = 1;
 		}
+		cdev_init(&dht22m_raw_cdevs[i], &dht22m_raw_cdevs_fops);
+		dht22m_raw_cdevs[i].owner = THIS_MODULE;
+		if (cdev_add(&dht22m_raw_cdevs[i], MKDEV(MAJOR(dht22m_dev),
+			     MINOR(dht22m_dev) + DHT22M_MAX_DEVICES + i), 1) < 0) {
+			printk(KERN_ERR "Failed to add raw cdev %d\n", i);
+		} else {
+			device_create(dht22m_class, NULL,
+				      MKDEV(MAJOR(dht22m_dev),
+					    MINOR(dht22m_dev) + DHT22M_MAX_DEVICES + i),
+				      NULL, "dht22m%d-raw", i);
+			raw_chardev_created[i] = 1;
+		}
+		if (dht22m_debugfs) {
+			char name[16];
+
+			snprintf(name, sizeof name, "dht22m%d", i);
+			sensor_debugfs[i] = debugfs_create_dir(name, dht22m_debugfs);
+			debugfs_create_file("failures", 0444, sensor_debugfs[i],
+					    (void *)(long)i, &failure_ring_fops);
+			debugfs_create_file("latency", 0444, sensor_debugfs[i],
+					    (void *)(long)i, &latency_fops);
+			debugfs_create_file("cpu_cost", 0444, sensor_debugfs[i],
+					    (void *)(long)i, &cpu_cost_fops);
+		}
 	}
 	return 0;
 }
@@ -672,7 +4162,43 @@ static void remove_devices(void)
 			cdev_del(&dht22m_cdevs[i]);
 			chardev_created[i] = 0;
 		}
+		if (raw_chardev_created[i]) {
+			device_destroy(dht22m_class,
+				       MKDEV(MAJOR(dht22m_dev),
+					     MINOR(dht22m_dev) + DHT22M_MAX_DEVICES + i));
+			cdev_del(&dht22m_raw_cdevs[i]);
+			raw_chardev_created[i] = 0;
+		}
+		debugfs_remove_recursive(sensor_debugfs[i]);
+		sensor_debugfs[i] = NULL;
+	}
+}
+
+/*
+ * sensor_types_parse() - Set the sensor types of the types parameter
+ * @buf: Type names separated by comma, the first one is of dht22m0.
+ *
+ * Parsing stops at the first unknown type.
+ */
+static void sensor_types_parse(const char *buf)
+{
+	char *list, *runner, *name;
+	int i = 0, type;
+
+	list = kstrdup(buf, GFP_KERNEL);
+	if (!list)
+		return;
+	runner = list;
+	while ((name = strsep(&runner, ",")) && i < DHT22M_MAX_DEVICES) {
+		type = sensor_type_parse(name);
+		if (type < 0) {
+			printk(KERN_ALERT DHT22M_MODULE_NAME
+			       ": unknown sensor type \"%s\"\n", name);
+			break;
+		}
+		sensor_types[i++] = type;
 	}
+	kfree(list);
 }
 
 /* Initialize the DHT22M module as it is loaded. */
@@ -680,13 +4206,50 @@ int __init dht22m_init(void)
 {
 	int i;
 	int error = 0;
-	unsigned long flags;
 
 	num_gpios = 0;
-	for (i = 0; i < DHT22M_MAX_DEVICES; ++i)
+	for_each_possible_cpu(i)
+		u64_stats_init(&per_cpu_ptr(&dht22_stats, i)->syncp);
+	for (i = 0; i < DHT22M_MAX_DEVICES; ++i) {
 		sensor_states[i] = DHT22M_STATES_ZEROCONF;
+		sensor_channels[i] = -1;
+		power_pins[i] = -1;
+		init_waitqueue_head(&raw_rings[i].wait);
+		seqcount_spinlock_init(&sensor_samples[i].seq, &sample_lock);
+		sensor_samples[i].sample.readstate = DTH22M_READSTATE_NEXT;
+		raw_spin_lock_init(&sensor_state[i].lock);
+		sensor_state[i].index = i;
+		sensor_state[i].readstate = DTH22M_READSTATE_NEXT;
+		sensor_state[i].readstate_since = ktime_get();
+		hrtimer_init(&sim_timers[i].timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS_HARD);
+		sim_timers[i].timer.function = sim_timer_fire;
+		sim_timers[i].state = &sensor_state[i];
+	}
+#ifdef DHT22M_BENCH
+	raw_spin_lock_init(&bench_state.lock);
+	bench_state.index = -1;
+#endif
+	printk(KERN_INFO DHT22M_MODULE_NAME
+	       ": Sensor state: %zu bytes, %zu cachelines per sensor\n",
+	       sizeof(struct dht22_state),
+	       DIV_ROUND_UP(sizeof(struct dht22_state), SMP_CACHE_BYTES));
+
+	kernel_param_lock(THIS_MODULE);
+	acq_thread = kthread_create(acq_thread_fn, NULL, DHT22M_MODULE_NAME "-acq");
+	if (IS_ERR(acq_thread)) {
+		error = PTR_ERR(acq_thread);
+		acq_thread = NULL;
+		kernel_param_unlock(THIS_MODULE);
+		printk(KERN_ALERT DHT22M_MODULE_NAME ": kthread_create failed\n");
+		goto kthread_create_failed;
+	}
+	acq_thread_configure();
+	kernel_param_unlock(THIS_MODULE);
+	cpu_latency_qos_add_request(&acq_qos, PM_QOS_DEFAULT_VALUE);
+	wake_up_process(acq_thread);
 
-	if ((error = alloc_chrdev_region(&dht22m_dev, 0, DHT22M_MAX_DEVICES,
+	if ((error = alloc_chrdev_region(&dht22m_dev, 0, DHT22M_MINORS,
 					 DHT22M_DEVICE_NAME)) < 0) {
 		printk(KERN_ALERT DHT22M_MODULE_NAME
 		       ": alloc_chrdev_region failed\n");
@@ -705,9 +4268,50 @@ int __init dht22m_init(void)
 		goto class_create_file_failed;
 	}
 
-	spin_lock_irqsave(&sensor_lock, flags);
-	sensor_state.readstate = DTH22M_READSTATE_NEXT;
-	spin_unlock_irqrestore(&sensor_lock, flags);
+	/* Debugfs is optional, the module works without it */
+	dht22m_debugfs = debugfs_create_dir(DHT22M_MODULE_NAME, NULL);
+	if (IS_ERR(dht22m_debugfs))
+		dht22m_debugfs = NULL;
+	if (dht22m_debugfs) {
+		debugfs_create_file("replay", 0644, dht22m_debugfs, NULL,
+				    &replay_fops);
+		debugfs_create_file("contention", 0444, dht22m_debugfs, NULL,
+				    &contention_fops);
+#ifdef DHT22M_BENCH
+		debugfs_create_file("bench_edge", 0400, dht22m_debugfs, NULL,
+				    &bench_edge_fops);
+#endif
+	}
+
+	dht22m_proc_metrics = proc_create_single(DHT22M_MODULE_NAME "_metrics",
+						 0444, NULL, metrics_show);
+	if (!dht22m_proc_metrics)
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": can not create /proc/" DHT22M_MODULE_NAME "_metrics\n");
+	dht22m_proc_summary = proc_create_single(DHT22M_MODULE_NAME, 0444, NULL,
+						 summary_show);
+	if (!dht22m_proc_summary)
+		printk(KERN_WARNING DHT22M_MODULE_NAME
+		       ": can not create /proc/" DHT22M_MODULE_NAME "\n");
+
+	if (types && *types)
+		sensor_types_parse(types);
+	if (mux_gpios && *mux_gpios)
+		mux_gpios_request();
+	if (gpios && *gpios) {
+		int new_gpio_pins[DHT22M_MAX_DEVICES];
+		int new_channels[DHT22M_MAX_DEVICES];
+		int new_powers[DHT22M_MAX_DEVICES];
+		int new_num_gpios = dht22m_parse_gpios(gpios, new_gpio_pins,
+						       new_channels, new_powers);
+
+		config_mutex_lock();
+		dht22m_set_gpios(new_gpio_pins, new_channels, new_powers,
+				 new_num_gpios);
+		mutex_unlock(&gpio_config_mutex);
+	}
+	WRITE_ONCE(sensor_period_enabled, true);
+	sensor_period_kick();
 
 	printk(KERN_INFO DHT22M_MODULE_NAME ": Init successfully.\n");
 	return 0;
@@ -715,22 +4319,38 @@ int __init dht22m_init(void)
 class_create_file_failed:
 	class_destroy(dht22m_class);
 class_create_failed:
-	unregister_chrdev_region(dht22m_dev, DHT22M_MAX_DEVICES);
+	unregister_chrdev_region(dht22m_dev, DHT22M_MINORS);
 alloc_chrdev_region_failed:
+	acq_thread_stop();
+	cpu_latency_qos_remove_request(&acq_qos);
+kthread_create_failed:
 	return error;
 }
 
 /* Clean up before the DHT22M module is unloaded. */
 void __exit dht22m_cleanup(void)
 {
-	mutex_lock(&gpio_config_mutex);
+	int i;
+
+	WRITE_ONCE(sensor_period_enabled, false);
+	acq_thread_stop();
+	cpu_latency_qos_remove_request(&acq_qos);
+	config_mutex_lock();
+	sensor_config_publish(false);
 	free_gpios();
 	remove_devices();
 	mutex_unlock(&gpio_config_mutex);
+	mux_gpios_free();
+	for (i = 0; i < DHT22M_MAX_DEVICES; i++)
+		hrtimer_cancel(&sim_timers[i].timer);
 
+	proc_remove(dht22m_proc_summary);
+	proc_remove(dht22m_proc_metrics);
+	debugfs_remove_recursive(dht22m_debugfs);
+	vfree(replay_state.results);
 	class_remove_file(dht22m_class, &dht22m_class_attr);
 	class_destroy(dht22m_class);
-	unregister_chrdev_region(dht22m_dev, DHT22M_MAX_DEVICES);
+	unregister_chrdev_region(dht22m_dev, DHT22M_MINORS);
 	printk(KERN_INFO DHT22M_MODULE_NAME ": Module unloaded\n");
 }
 
@@ -0,0 +1,217 @@
+/*
+ * Binary interface of the dht22m kernel module
+ *
+ * Copyright 2025, Péter Deák (hyper80@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This header is shared by the kernel module and the userspace tools
+ * which process the frames of the /dev/dht22mX-raw devices or decode
+ * the sensor data themselves.
+ */
+
+#ifndef DHT22M_H
+#define DHT22M_H
+
+#include <linux/types.h>
+
+/* Result of a sensor read */
+#define DTH22M_READSTATE_COLLECT	0
+#define DTH22M_READSTATE_OK		1
+#define DTH22M_READSTATE_CHKSUMERR	2
+#define DTH22M_READSTATE_OTHERR		3
+#define DTH22M_READSTATE_TOOSOON	4
+#define DTH22M_READSTATE_NEXT		5
+
+/* "DH22" in little endian, first field of every frame */
+#define DHT22M_FRAME_MAGIC	0x32324844
+
+/*
+ * Number of timestamps of a complete read: the start of the read,
+ * two falling edges of the sensor response and one edge for every bit.
+ */
+#define DHT22M_FRAME_EDGES	(1 + 2 + 5*8)
+
+/* Sensor types: the protocol variants of the DHT sensor family */
+#define DHT22M_TYPE_DHT22	0	/* DHT22, AM2302 */
+#define DHT22M_TYPE_DHT11	1
+#define DHT22M_TYPE_AM2301	2	/* AM2301, DHT21 */
+#define DHT22M_TYPE_AM2320	3	/* AM2320 in single bus mode */
+#define DHT22M_TYPES		4
+
+/* The frame is generated by a simulated sensor */
+#define DHT22M_FRAME_FLAG_SIMULATED	0x1
+
+/*
+ * struct dht22m_frame - Raw edge timings of one finished sensor read.
+ *
+ * @magic: DHT22M_FRAME_MAGIC
+ * @sequence: Frame number on the sensor. A gap means lost frames.
+ * @realtime_ns: System time when the read was finished.
+ * @gpio: The gpio of the sensor.
+ * @flags: DHT22M_FRAME_FLAG_* bits.
+ * @readstate: Result of the read (DTH22M_READSTATE_*).
+ * @num_edges: Number of timestamps recorded during the read.
+ * @bytes: The decoded bytes (valid if readstate is OK or CHKSUMERR).
+ * @type: DHT22M_TYPE_* of the sensor (zero in the frames of older modules).
+ * @deltas: Time between the consecutive timestamps in nanoseconds.
+ *          deltas[0] is the start signal plus the sensor response,
+ *          only the first num_edges - 1 values are valid.
+ */
+struct dht22m_frame {
+	__u32 magic;
+	__u32 sequence;
+	__u64 realtime_ns;
+	__s32 gpio;
+	__u32 flags;
+	__u8 readstate;
+	__u8 num_edges;
+	__u8 bytes[5];
+	__u8 type;
+	__u32 deltas[DHT22M_FRAME_EDGES - 1];
+};
+
+/* Bit decoders */
+#define DHT22M_DECODER_THRESHOLD	0
+#define DHT22M_DECODER_ADAPTIVE		1
+
+/*
+ * Boundary between the "0" and "1" bit periods.
+ * According to the data sheet: (Aosong AM2302)
+ *                             Min   Typ   Max  (µs)
+ *  Signal "0", "1" low time   48    50    55
+ *  Signal "0" high time       22    26    30
+ *  Signal "1" high time       68    70    75
+ * Derived: longest "0" period is 85, the shortest "1" period is 116
+ * the middle between two values is ~ 101 µs
+ */
+#define DHT22M_BIT_THRESHOLD_US		101
+
+/*
+ * dht22m_adaptive_threshold_us() - Bit period boundary fitted to the frame.
+ * @periods_ns: The 40 bit periods (falling edge to falling edge).
+ *
+ * Splits the bit periods at DHT22M_BIT_THRESHOLD_US and returns the middle
+ * between the average "0" and "1" periods of the frame. This follows a
+ * sensor or an edge capture path which is systematically slow or fast.
+ * If the frame has only one kind of bits the data sheet value is kept.
+ *
+ * Return: The boundary between the "0" and "1" periods in µs.
+ */
+static inline __u32 dht22m_adaptive_threshold_us(const __u32 *periods_ns)
+{
+	__u32 sum_short = 0, sum_long = 0, n_short = 0, n_long = 0;
+	__u32 width;
+	int i;
+
+	for (i = 0; i < 5*8; i++) {
+		width = periods_ns[i] / 1000;
+		if (width > DHT22M_BIT_THRESHOLD_US) {
+			sum_long += width;
+			n_long++;
+		} else {
+			sum_short += width;
+			n_short++;
+		}
+	}
+	if (n_short == 0 || n_long == 0)
+		return DHT22M_BIT_THRESHOLD_US;
+	return (sum_short / n_short + sum_long / n_long) / 2;
+}
+
+/*
+ * dht22m_decode_bits() - Decode the bit periods of a frame.
+ * @periods_ns: The 40 bit periods (falling edge to falling edge).
+ * @decoder: DHT22M_DECODER_THRESHOLD or DHT22M_DECODER_ADAPTIVE
+ * @bytes: The decoded 5 bytes.
+ *
+ * A long period is a "1" bit, a short one is a "0" bit.
+ * Used by the kernel module and the userspace reference reader.
+ *
+ * Return: DTH22M_READSTATE_OK or DTH22M_READSTATE_CHKSUMERR
+ */
+static inline int dht22m_decode_bits(const __u32 *periods_ns, int decoder,
+				     __u8 *bytes)
+{
+	__u32 threshold = DHT22M_BIT_THRESHOLD_US;
+	int i;
+
+	if (decoder == DHT22M_DECODER_ADAPTIVE)
+		threshold = dht22m_adaptive_threshold_us(periods_ns);
+	for (i = 0; i < 5; i++)
+		bytes[i] = 0;
+	for (i = 0; i < 5*8; i++)
+		if (periods_ns[i] / 1000 > threshold)
+			bytes[i / 8] |= 1 << (7 - (i & 7));
+	if ((__u8)(bytes[0] + bytes[1] + bytes[2] + bytes[3]) != bytes[4])
+		return DTH22M_READSTATE_CHKSUMERR;
+	return DTH22M_READSTATE_OK;
+}
+
+/* dht22m_type_name() - Name of a sensor type, NULL if the type is unknown */
+static inline const char *dht22m_type_name(int type)
+{
+	switch (type) {
+	case DHT22M_TYPE_DHT22:
+		return "dht22";
+	case DHT22M_TYPE_DHT11:
+		return "dht11";
+	case DHT22M_TYPE_AM2301:
+		return "am2301";
+	case DHT22M_TYPE_AM2320:
+		return "am2320";
+	default:
+		return 0;
+	}
+}
+
+/*
+ * dht22m_type_start_us() - Length of the start signal of a sensor type.
+ *
+ * The DHT11 needs at least 18 ms, the others 0.8-20 ms (typically 1 ms).
+ * The DHT22 keeps the 1.5 ms used since the first versions.
+ */
+static inline __u32 dht22m_type_start_us(int type)
+{
+	switch (type) {
+	case DHT22M_TYPE_DHT11:
+		return 20000;
+	case DHT22M_TYPE_AM2301:
+	case DHT22M_TYPE_AM2320:
+		return 1000;
+	default:
+		return 1500;
+	}
+}
+
+/*
+ * dht22m_decode_values() - Temperature and humidity of the decoded bytes.
+ * @type: DHT22M_TYPE_* of the sensor.
+ * @bytes: The 5 decoded bytes with a valid checksum.
+ * @negative: Set to 1 if the temperature is negative, 0 otherwise.
+ * @temperature: Absolute value of the temperature (times ten).
+ * @humidity: Relative humidity (times ten).
+ *
+ * The DHT22, AM2301 and AM2320 send 16 bit values in tenths (the sign of
+ * the temperature is the top bit). The DHT11 sends the integral and the
+ * decimal part in separate bytes; the sign is the top bit of the
+ * temperature decimal on the newer revisions.
+ */
+static inline void dht22m_decode_values(int type, const __u8 *bytes,
+					int *negative, int *temperature,
+					int *humidity)
+{
+	if (type == DHT22M_TYPE_DHT11) {
+		*humidity = bytes[0] * 10 + bytes[1] % 10;
+		*temperature = bytes[2] * 10 + (bytes[3] & 0x7f) % 10;
+		*negative = (bytes[3] & 0x80) != 0;
+		return;
+	}
+	*humidity = bytes[0] * 256 + bytes[1];
+	*temperature = (bytes[2] & 0x7f) * 256 + bytes[3];
+	*negative = (bytes[2] & 0x80) != 0;
+}
+
+#endif /* DHT22M_H */
@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# Kernel module versus userspace reader benchmark
+#
+# Copyright 2025, Péter Deák (hyper80@gmail.com)
+# License GPLv2
+#
+# Reads the same sensor with the dht22m kernel module and with the
+# userspace reference reader (tools/dht22m-ureader, GPIO character
+# device v2 edge events with kernel timestamps and the same bit decoder)
+# under the same load, and reports success rate, read latency and CPU
+# time per sample of both. The two readers can not own the line at the
+# same time, so the module releases it while the userspace reader runs.
+#
+# The module reads run in its acquisition thread and the edge interrupt,
+# so its CPU time is taken from the debugfs cpu_cost file of the sensor
+# ("rusage+cpu_cost" in the cpu_source column). Without debugfs only the
+# CPU time of the reader process is known ("rusage"), which misses almost
+# all of it. The periodic reads are stopped during the benchmark, so every
+# read of the device is a new sensor read.
+#
+# Usage: sudo tools/dht22m-compare.sh -g GPIO -c GPIOCHIP -l OFFSET [options]
+#   -g GPIO       Kernel GPIO number of the sensor (as written to gpiolist)
+#   -c GPIOCHIP   Gpio chip of the sensor for the userspace reader (/dev/gpiochipN)
+#   -l OFFSET     Line offset of the sensor on the chip
+#   -n READS      Reads by both readers (default: 100)
+#   -i MS         Time between the reads (default: 2100)
+#   -w WORKERS    CPU load workers, 0: no load (default: number of CPUs)
+#   -I            Add interrupt load (needs stress-ng)
+
+DIR=$(dirname "$0")
+READER=$DIR/dht22m-ureader
+GPIO=""
+CHIP=""
+OFFSET=""
+READS=100
+INTERVAL=2100
+WORKERS=$(nproc)
+IRQLOAD=0
+
+while getopts "g:c:l:n:i:w:Ih" opt; do
+	case $opt in
+	g) GPIO=$OPTARG ;;
+	c) CHIP=$OPTARG ;;
+	l) OFFSET=$OPTARG ;;
+	n) READS=$OPTARG ;;
+	i) INTERVAL=$OPTARG ;;
+	w) WORKERS=$OPTARG ;;
+	I) IRQLOAD=1 ;;
+	*) sed -n '/^# Usage/,/^$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+	esac
+done
+
+if [ -z "$GPIO" ] || [ -z "$CHIP" ] || [ -z "$OFFSET" ]; then
+	sed -n '/^# Usage/,/^$/s/^# \{0,1\}//p' "$0"
+	exit 1
+fi
+if [ "$(id -u)" != "0" ]; then
+	echo "Must be run as root" >&2
+	exit 1
+fi
+if [ ! -x "$READER" ]; then
+	echo "$READER not found, run make in $DIR" >&2
+	exit 1
+fi
+if [ ! -f /sys/class/dht22m/gpiolist ]; then
+	echo "The dht22m module is not loaded" >&2
+	exit 1
+fi
+
+SAVED_GPIOS=$(cat /sys/class/dht22m/gpiolist)
+SAVED_PERIOD=$(cat /sys/module/dht22m/parameters/period_ms)
+COST=/sys/kernel/debug/dht22m/dht22m0/cpu_cost
+LOAD_PIDS=""
+
+cleanup() {
+	[ -n "$LOAD_PIDS" ] && kill $LOAD_PIDS 2>/dev/null
+	wait 2>/dev/null
+	echo "$SAVED_GPIOS" > /sys/class/dht22m/gpiolist
+	echo "$SAVED_PERIOD" > /sys/module/dht22m/parameters/period_ms
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if command -v stress-ng > /dev/null; then
+	if [ "$WORKERS" -gt 0 ]; then
+		stress-ng --cpu "$WORKERS" --quiet &
+		LOAD_PIDS="$LOAD_PIDS $!"
+	fi
+	if [ "$IRQLOAD" = "1" ]; then
+		stress-ng --timer "$(nproc)" --timer-freq 100000 --quiet &
+		LOAD_PIDS="$LOAD_PIDS $!"
+	fi
+else
+	if [ "$IRQLOAD" = "1" ]; then
+		echo "Interrupt load needs stress-ng" >&2
+		exit 1
+	fi
+	for i in $(seq 1 "$WORKERS"); do
+		( while :; do :; done ) &
+		LOAD_PIDS="$LOAD_PIDS $!"
+	done
+fi
+
+echo "Load: $WORKERS CPU workers, interrupt load: $IRQLOAD, reads: $READS"
+printf "%-7s %6s %6s %7s %6s %8s %12s %12s %12s  %s\n" reader reads ok chksum \
+	other error_% latency_us cpu_us/read cpu_us/ok cpu_source
+
+report() {
+	awk '{ printf "%-7s %6s %6s %7s %6s %8s %12s %12s %12s  %s\n",
+		$1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }'
+}
+
+echo 0 > /sys/module/dht22m/parameters/period_ms
+echo "$GPIO" > /sys/class/dht22m/gpiolist
+if [ -r "$COST" ]; then
+	"$READER" -k /dev/dht22m0 -C "$COST" -n "$READS" -i "$INTERVAL" -b | report
+else
+	echo "$COST not found (is debugfs mounted?), the kernel CPU time is incomplete" >&2
+	"$READER" -k /dev/dht22m0 -n "$READS" -i "$INTERVAL" -b | report
+fi
+
+echo "" > /sys/class/dht22m/gpiolist
+"$READER" -c "$CHIP" -l "$OFFSET" -n "$READS" -i "$INTERVAL" -b | report
@@ -0,0 +1,158 @@
+#!/bin/bash
+#
+# Stress harness of the dht22m kernel module
+#
+# Copyright 2025, Péter Deák (hyper80@gmail.com)
+# License GPLv2
+#
+# Loads the module with timed simulated sensors (the edges are generated
+# in real time by a hrtimer, so the system load delays them like real
+# GPIO interrupts), injects extra random edge latency and reads the
+# sensors under CPU and interrupt load. Reports the error rate and the
+# read latency for every decoder mode and injected latency, so every
+# change of the module can be judged by the same reliability numbers.
+#
+# Usage: sudo tools/dht22m-stress.sh [options]
+#   -m MODULE     Path of the module (default: ./dht22m.ko)
+#   -s SENSORS    Number of simulated sensors (default: 4)
+#   -n READS      Reads per sensor in every configuration (default: 250)
+#   -l LATENCIES  Injected maximum edge latencies in ns (default: "0 10000 20000 40000")
+#   -d DECODERS   Decoder modes (default: "0 1")
+#   -c WORKERS    CPU load workers, 0: no load (default: number of CPUs)
+#   -i            Add interrupt load (needs stress-ng)
+#   -o FILE       Write the results to a CSV file too
+
+# EPOCHREALTIME must use decimal point
+export LC_ALL=C
+
+MODULE=./dht22m.ko
+SENSORS=4
+READS=250
+LATENCIES="0 10000 20000 40000"
+DECODERS="0 1"
+WORKERS=$(nproc)
+IRQLOAD=0
+CSV=""
+
+while getopts "m:s:n:l:d:c:io:h" opt; do
+	case $opt in
+	m) MODULE=$OPTARG ;;
+	s) SENSORS=$OPTARG ;;
+	n) READS=$OPTARG ;;
+	l) LATENCIES=$OPTARG ;;
+	d) DECODERS=$OPTARG ;;
+	c) WORKERS=$OPTARG ;;
+	i) IRQLOAD=1 ;;
+	o) CSV=$OPTARG ;;
+	*) sed -n '/^# Usage/,/^$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+	esac
+done
+
+if [ "$(id -u)" != "0" ]; then
+	echo "Must be run as root" >&2
+	exit 1
+fi
+if [ ! -f "$MODULE" ]; then
+	echo "Module $MODULE not found, build it first" >&2
+	exit 1
+fi
+if lsmod | grep -q "^dht22m "; then
+	echo "The dht22m module is loaded, unload it first" >&2
+	exit 1
+fi
+
+LOAD_PIDS=""
+TMPDIR=$(mktemp -d)
+
+cleanup() {
+	[ -n "$LOAD_PIDS" ] && kill $LOAD_PIDS 2>/dev/null
+	wait 2>/dev/null
+	lsmod | grep -q "^dht22m " && rmmod dht22m
+	rm -rf "$TMPDIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+start_load() {
+	if command -v stress-ng > /dev/null; then
+		if [ "$WORKERS" -gt 0 ]; then
+			stress-ng --cpu "$WORKERS" --quiet &
+			LOAD_PIDS="$LOAD_PIDS $!"
+		fi
+		if [ "$IRQLOAD" = "1" ]; then
+			stress-ng --timer "$(nproc)" --timer-freq 100000 --quiet &
+			LOAD_PIDS="$LOAD_PIDS $!"
+		fi
+		return
+	fi
+	if [ "$IRQLOAD" = "1" ]; then
+		echo "Interrupt load needs stress-ng" >&2
+		exit 1
+	fi
+	for i in $(seq 1 "$WORKERS"); do
+		( while :; do :; done ) &
+		LOAD_PIDS="$LOAD_PIDS $!"
+	done
+}
+
+# run_config DECODER LATENCY - One measurement, prints a CSV line
+run_config() {
+	local decoder=$1 latency=$2
+	local sensor line start end n ok=0 chksum=0 other=0 gpios=""
+
+	# No quarantine: the failed reads must reach the decoder every time
+	insmod "$MODULE" simulate=1 sim_timed=1 sim_noise_ns=2000 \
+		sim_latency_ns="$latency" decoder="$decoder" \
+		quarantine_failures=0 || exit 1
+	for sensor in $(seq 0 $((SENSORS - 1))); do
+		gpios="${gpios:+$gpios }$sensor"
+	done
+	echo "$gpios" > /sys/class/dht22m/gpiolist
+	if [ ! -e /dev/dht22m0 ]; then
+		echo "No sensor is configured by the gpiolist \"$gpios\"" >&2
+		rmmod dht22m
+		exit 1
+	fi
+	: > "$TMPDIR/latency"
+
+	for n in $(seq 1 "$READS"); do
+		for sensor in $(seq 0 $((SENSORS - 1))); do
+			start=$EPOCHREALTIME
+			read -r line < "/dev/dht22m$sensor"
+			end=$EPOCHREALTIME
+			echo "$start $end" >> "$TMPDIR/latency"
+			case $line in
+			Ok\;*) ok=$((ok + 1)) ;;
+			ChecksumError) chksum=$((chksum + 1)) ;;
+			*) other=$((other + 1)) ;;
+			esac
+		done
+	done
+	rmmod dht22m
+
+	awk '{ print ($2 - $1) * 1000000 }' "$TMPDIR/latency" | sort -n |
+	awk -v d="$decoder" -v l="$latency" -v ok=$ok -v c=$chksum -v o=$other '
+		{ lat[NR] = $1; sum += $1 }
+		END {
+			printf "%s,%s,%d,%d,%d,%d,%.2f,%.0f,%.0f,%.0f\n", d, l, NR, ok, c, o,
+			       (c + o) * 100 / NR, sum / NR,
+			       lat[int(NR * 0.5) + 1], lat[int(NR * 0.99) + 1]
+		}'
+}
+
+start_load
+echo "Load: $WORKERS CPU workers, interrupt load: $IRQLOAD"
+echo "Sensors: $SENSORS, reads per sensor: $READS"
+printf "%-8s %-11s %7s %7s %7s %7s %8s %9s %9s %9s\n" decoder latency_ns \
+	reads ok chksum other error_% avg_us p50_us p99_us
+HEADER="decoder,latency_ns,reads,ok,checksum_error,other_error,error_pct,avg_us,p50_us,p99_us"
+[ -n "$CSV" ] && echo "$HEADER" > "$CSV"
+
+for decoder in $DECODERS; do
+	for latency in $LATENCIES; do
+		result=$(run_config "$decoder" "$latency") || exit 1
+		[ -n "$CSV" ] && echo "$result" >> "$CSV"
+		echo "$result" | awk -F, '{ printf "%-8s %-11s %7s %7s %7s %7s %8s %9s %9s %9s\n",
+			$1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }'
+	done
+done
@@ -0,0 +1,341 @@
+/*
+ * Reference userspace DHT22 reader for comparison with the dht22m module
+ *
+ * Copyright 2025, Péter Deák (hyper80@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * Reads a DHT22 sensor from userspace through the GPIO character device
+ * (uAPI v2) using falling edge events with kernel timestamps, and decodes
+ * the frames with the same dht22m_decode_bits() as the kernel module.
+ * It can also read the /dev/dht22mX devices of the module, so the two
+ * ways can be benchmarked with the same program:
+ *
+ *   dht22m-ureader -c /dev/gpiochip0 -l 4 -n 100 -b     (userspace)
+ *   dht22m-ureader -k /dev/dht22m0 -n 100 -b            (kernel module)
+ *
+ * The -t option selects the sensor type (dht22, dht11, am2301, am2320)
+ * of the userspace reads: the start signal and the byte layout.
+ *
+ * Without -b every result is printed as the module does ("Ok;21.5;45.0").
+ * With -b only a summary line is printed: reads, successful reads,
+ * checksum errors, other errors, error percentage, average read latency,
+ * CPU time per read and per successful read (microseconds) and the source
+ * of the CPU time.
+ *
+ * The CPU time of the reader process (getrusage, "rusage") holds the
+ * whole userspace read, but not the module reads: they run in the
+ * acquisition thread and the edge interrupt. With -C the total of the
+ * debugfs cpu_cost file of the sensor is added ("rusage+cpu_cost"):
+ *
+ *   dht22m-ureader -k /dev/dht22m0 -C /sys/kernel/debug/dht22m/dht22m0/cpu_cost -b
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+
+#include "../dht22m.h"
+
+#define FRAME_TIMEOUT_MS	20
+#define EVENT_BUFFER_SIZE	64
+
+struct stats {
+	unsigned int reads;
+	unsigned int ok;
+	unsigned int chksum;
+	unsigned int other;
+	double latency_us;
+};
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+	       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * module_cpu_ns() - CPU time spent by the module on a sensor.
+ * @path: The debugfs cpu_cost file of the sensor.
+ *
+ * Return: The total_ns of the "total" line, 0 if it can not be read.
+ */
+static __u64 module_cpu_ns(const char *path)
+{
+	unsigned long long total = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+	while (fgets(line, sizeof line, f))
+		if (sscanf(line, "total %llu", &total) == 1)
+			break;
+	fclose(f);
+	return total;
+}
+
+/* line_config() - Switch the requested line to output low or edge input */
+static int line_config(int line_fd, int output)
+{
+	struct gpio_v2_line_config config;
+
+	memset(&config, 0, sizeof config);
+	if (output) {
+		config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+		config.num_attrs = 1;
+		config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		config.attrs[0].attr.values = 0;
+		config.attrs[0].mask = 1;
+	} else {
+		config.flags = GPIO_V2_LINE_FLAG_INPUT |
+			       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	}
+	return ioctl(line_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config);
+}
+
+/* line_request() - Request the sensor line as edge detecting input */
+static int line_request(const char *chip, unsigned int offset)
+{
+	struct gpio_v2_line_request request;
+	int chip_fd;
+
+	chip_fd = open(chip, O_RDONLY);
+	if (chip_fd < 0) {
+		perror(chip);
+		return -1;
+	}
+	memset(&request, 0, sizeof request);
+	request.offsets[0] = offset;
+	request.num_lines = 1;
+	request.event_buffer_size = EVENT_BUFFER_SIZE;
+	request.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+			       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	strncpy(request.consumer, "dht22m-ureader", sizeof request.consumer - 1);
+	if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+		perror("GPIO_V2_GET_LINE_IOCTL");
+		close(chip_fd);
+		return -1;
+	}
+	close(chip_fd);
+	return request.fd;
+}
+
+/*
+ * user_read() - One sensor read from userspace.
+ *
+ * Sends the start pulse of the sensor type, collects the falling edges for
+ * 20 ms after it and decodes them exactly as the module does: edges closer
+ * than 500 µs to the start are dropped, the 40 bits are at timestamps 3..42.
+ */
+static int user_read(int line_fd, int type, __u8 *bytes)
+{
+	__u64 start_ns = dht22m_type_start_us(type) * 1000ull;
+	struct gpio_v2_line_event events[EVENT_BUFFER_SIZE];
+	__u64 timestamps[DHT22M_FRAME_EDGES];
+	__u32 periods[5*8];
+	struct pollfd pfd = { .fd = line_fd, .events = POLLIN };
+	int num_edges = 1;
+	__u64 deadline;
+	ssize_t len;
+	int i, n, timeout;
+
+	/* Drop the events of the previous read */
+	while (poll(&pfd, 1, 0) > 0 && read(line_fd, events, sizeof events) > 0)
+		;
+
+	timestamps[0] = now_ns();
+	if (line_config(line_fd, 1) < 0)
+		return DTH22M_READSTATE_OTHERR;
+	/* The long DHT11 start signal is slept, the module does so too */
+	if (start_ns > 2000000)
+		usleep(start_ns / 1000);
+	while (now_ns() - timestamps[0] < start_ns)
+		;
+	if (line_config(line_fd, 0) < 0)
+		return DTH22M_READSTATE_OTHERR;
+
+	deadline = timestamps[0] + start_ns + FRAME_TIMEOUT_MS * 1000000ull;
+	while (num_edges < DHT22M_FRAME_EDGES) {
+		timeout = (int)(((__s64)(deadline - now_ns())) / 1000000);
+		if (timeout < 0 || poll(&pfd, 1, timeout) <= 0)
+			break;
+		len = read(line_fd, events, sizeof events);
+		if (len <= 0)
+			break;
+		n = len / sizeof events[0];
+		for (i = 0; i < n && num_edges < DHT22M_FRAME_EDGES; i++) {
+			if (num_edges == 1 &&
+			    events[i].timestamp_ns - timestamps[0] < 500000)
+				continue;
+			timestamps[num_edges++] = events[i].timestamp_ns;
+		}
+	}
+	if (num_edges < DHT22M_FRAME_EDGES)
+		return DTH22M_READSTATE_OTHERR;
+	for (i = 0; i < 5*8; i++)
+		periods[i] = timestamps[i + 3] - timestamps[i + 2];
+	return dht22m_decode_bits(periods, DHT22M_DECODER_THRESHOLD, bytes);
+}
+
+/* kernel_read() - One sensor read through a dht22mX device of the module */
+static int kernel_read(const char *device, char *line, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return DTH22M_READSTATE_OTHERR;
+	len = read(fd, line, size - 1);
+	close(fd);
+	if (len <= 0)
+		return DTH22M_READSTATE_OTHERR;
+	line[len] = '\0';
+	if (strncmp(line, "Ok;", 3) == 0)
+		return DTH22M_READSTATE_OK;
+	if (strncmp(line, "ChecksumError", 13) == 0)
+		return DTH22M_READSTATE_CHKSUMERR;
+	return DTH22M_READSTATE_OTHERR;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s (-c GPIOCHIP -l OFFSET [-t TYPE] | -k DEVICE [-C CPU_COST]) [-n READS] [-i INTERVAL_MS] [-b]\n"
+		"  -c GPIOCHIP    Read from userspace through this gpio chip\n"
+		"  -l OFFSET      Line offset of the sensor on the chip\n"
+		"  -t TYPE        Sensor type: dht22, dht11, am2301, am2320 (default: dht22)\n"
+		"  -k DEVICE      Read the /dev/dht22mX device of the module\n"
+		"  -C CPU_COST    Add the CPU time in this debugfs cpu_cost file of the module\n"
+		"  -n READS       Number of reads (default: 1)\n"
+		"  -i INTERVAL_MS Time between the start of the reads (default: 2100)\n"
+		"  -b             Benchmark: print only a summary\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *chip = NULL, *device = NULL, *cost = NULL;
+	unsigned int offset = 0, reads = 1, interval_ms = 2100, n;
+	int bench = 0, line_fd = -1, type = DHT22M_TYPE_DHT22, readstate, opt;
+	struct stats stats = { 0 };
+	__u64 module_start = 0;
+	double cpu_start, cpu;
+	__u64 start, next;
+	char line[64];
+	__u8 bytes[5];
+
+	while ((opt = getopt(argc, argv, "c:l:t:k:C:n:i:b")) != -1) {
+		switch (opt) {
+		case 'c': chip = optarg; break;
+		case 'l': offset = atoi(optarg); break;
+		case 't':
+			for (type = 0; type < DHT22M_TYPES; type++)
+				if (strcmp(optarg, dht22m_type_name(type)) == 0)
+					break;
+			if (type == DHT22M_TYPES)
+				usage(argv[0]);
+			break;
+		case 'k': device = optarg; break;
+		case 'C': cost = optarg; break;
+		case 'n': reads = atoi(optarg); break;
+		case 'i': interval_ms = atoi(optarg); break;
+		case 'b': bench = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!chip == !device || (chip && cost) || reads == 0)
+		usage(argv[0]);
+	if (chip) {
+		line_fd = line_request(chip, offset);
+		if (line_fd < 0)
+			return 1;
+	}
+
+	if (cost)
+		module_start = module_cpu_ns(cost);
+	cpu_start = cpu_us();
+	next = now_ns();
+	for (n = 0; n < reads; n++) {
+		while (now_ns() < next)
+			usleep(1000);
+		next += interval_ms * 1000000ull;
+
+		start = now_ns();
+		if (chip)
+			readstate = user_read(line_fd, type, bytes);
+		else
+			readstate = kernel_read(device, line, sizeof line);
+		stats.latency_us += (now_ns() - start) / 1000.0;
+		stats.reads++;
+		if (readstate == DTH22M_READSTATE_OK)
+			stats.ok++;
+		else if (readstate == DTH22M_READSTATE_CHKSUMERR)
+			stats.chksum++;
+		else
+			stats.other++;
+
+		if (bench)
+			continue;
+		if (device) {
+			fputs(line, stdout);
+		} else if (readstate == DTH22M_READSTATE_OK) {
+			int negative, temperature, humidity;
+
+			dht22m_decode_values(type, bytes, &negative,
+					     &temperature, &humidity);
+			printf("Ok;%s%d.%d;%d.%d\n", negative ? "-" : "",
+			       temperature / 10, temperature % 10,
+			       humidity / 10, humidity % 10);
+		} else if (readstate == DTH22M_READSTATE_CHKSUMERR) {
+			printf("ChecksumError\n");
+		} else {
+			printf("IOError\n");
+		}
+		fflush(stdout);
+	}
+	cpu = cpu_us() - cpu_start;
+	if (cost) {
+		__u64 module_end = module_cpu_ns(cost);
+
+		if (module_end >= module_start)
+			cpu += (module_end - module_start) / 1000.0;
+	}
+
+	if (bench)
+		printf("%s %u %u %u %u %.2f %.0f %.1f %.1f %s\n",
+		       chip ? "user" : "kernel", stats.reads, stats.ok,
+		       stats.chksum, stats.other,
+		       100.0 * (stats.chksum + stats.other) / stats.reads,
+		       stats.latency_us / stats.reads, cpu / stats.reads,
+		       stats.ok ? cpu / stats.ok : 0.0,
+		       cost ? "rusage+cpu_cost" : "rusage");
+	if (line_fd >= 0)
+		close(line_fd);
+	return 0;
+}